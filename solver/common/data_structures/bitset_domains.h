@@ -0,0 +1,221 @@
+#pragma once
+
+#include "common/base.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace ds {
+// A fixed number of subsets of {0, ..., nbits - 1} stored as bitsets, for
+// the domains of a backtracking search. Every changed word is recorded on a
+// trail, so Undo() restores the state of the last Mark() in O(changed words).
+// Bits can only be removed between Mark() and Undo(). Scans are limited to
+// the range of words that may still be nonzero, which is trailed as well.
+class BitsetDomains {
+ public:
+  using TWord = uint64_t;
+  static const unsigned bits_per_word = 64;
+
+ protected:
+  struct Change {
+    size_t word;
+    TWord old;
+  };
+
+  struct Range {
+    unsigned begin, end;
+  };
+
+  struct RangeChange {
+    unsigned set;
+    Range old;
+  };
+
+  unsigned nsets = 0, nbits = 0, nwords = 0;
+  std::vector<TWord> words;
+  std::vector<unsigned> sizes;
+  std::vector<Range> ranges;
+  std::vector<Change> trail;
+  std::vector<RangeChange> ranges_trail;
+  std::vector<std::pair<size_t, size_t>> marks;
+  std::vector<TWord> kept;
+  std::vector<unsigned> kept_words;
+
+ public:
+  // All sets are full.
+  void Init(unsigned _nsets, unsigned _nbits) {
+    nsets = _nsets;
+    nbits = _nbits;
+    nwords = (nbits + bits_per_word - 1) / bits_per_word;
+    words.assign(size_t(nsets) * nwords, ~TWord(0));
+    if (nbits % bits_per_word) {
+      for (unsigned s = 0; s < nsets; ++s)
+        words[size_t(s) * nwords + nwords - 1] =
+            (TWord(1) << (nbits % bits_per_word)) - 1;
+    }
+    sizes.assign(nsets, nbits);
+    ranges.assign(nsets, {0, nwords});
+    trail.clear();
+    ranges_trail.clear();
+    marks.clear();
+    kept.assign(nwords, 0);
+    kept_words.clear();
+  }
+
+  unsigned Sets() const { return nsets; }
+  unsigned Bits() const { return nbits; }
+  unsigned Size(unsigned set) const { return sizes[set]; }
+
+  // Bits outside [first, last) are not in the set.
+  std::pair<unsigned, unsigned> BitRange(unsigned set) const {
+    return {ranges[set].begin * bits_per_word,
+            std::min(ranges[set].end * bits_per_word, nbits)};
+  }
+
+  bool HasKey(unsigned set, unsigned bit) const {
+    return (words[size_t(set) * nwords + bit / bits_per_word] >>
+            (bit % bits_per_word)) & 1;
+  }
+
+  void AndWord(unsigned set, unsigned word, TWord mask) {
+    size_t k = size_t(set) * nwords + word;
+    TWord value = words[k] & mask;
+    if (words[k] == value) return;
+    trail.push_back({k, words[k]});
+    sizes[set] -= __builtin_popcountll(words[k] ^ value);
+    words[k] = value;
+  }
+
+  // Keeps only the bits i with keep(i).
+  template <class TFilter>
+  void Filter(unsigned set, TFilter keep) {
+    const TWord* p = &words[size_t(set) * nwords];
+    Range r = ranges[set], nr{r.end, r.begin};
+    for (unsigned w = r.begin; w < r.end; ++w) {
+      TWord value = p[w], kept = value;
+      if (!value) continue;
+      for (TWord m = value; m; m &= m - 1) {
+        unsigned b = __builtin_ctzll(m);
+        if (!keep(w * bits_per_word + b)) kept &= ~(TWord(1) << b);
+      }
+      AndWord(set, w, kept);
+      if (kept) {
+        nr.begin = std::min(nr.begin, w);
+        nr.end = w + 1;
+      }
+    }
+    if (nr.begin >= nr.end) nr = {0, 0};
+    if ((nr.begin != r.begin) || (nr.end != r.end)) {
+      ranges_trail.push_back({set, r});
+      ranges[set] = nr;
+    }
+  }
+
+  // Keep(i) collects bits for a following RestrictToKept(); this costs the
+  // number of collected bits instead of the size of the domain.
+  void Keep(unsigned bit) {
+    unsigned w = bit / bits_per_word;
+    if (!kept[w]) kept_words.push_back(w);
+    kept[w] |= TWord(1) << (bit % bits_per_word);
+  }
+
+  // Keep(i) for all i in [begin, end), a word at a time.
+  void KeepRange(unsigned begin, unsigned end) {
+    while (begin < end) {
+      unsigned w = begin / bits_per_word, b = begin % bits_per_word;
+      unsigned n = std::min(end - begin, bits_per_word - b);
+      TWord mask = (n == bits_per_word) ? ~TWord(0)
+                                        : ((TWord(1) << n) - 1) << b;
+      if (!kept[w]) kept_words.push_back(w);
+      kept[w] |= mask;
+      begin += n;
+    }
+  }
+
+  bool Kept(unsigned bit) const {
+    return (kept[bit / bits_per_word] >> (bit % bits_per_word)) & 1;
+  }
+
+  // Intersects the set with the collected bits and clears them, unless
+  // they are needed for more sets.
+  void RestrictToKept(unsigned set, bool clear = true) {
+    Range r = ranges[set], nr{r.end, r.begin};
+    for (unsigned w : kept_words) {
+      if ((w < r.begin) || (w >= r.end)) continue;
+      if (words[size_t(set) * nwords + w] & kept[w]) {
+        nr.begin = std::min(nr.begin, w);
+        nr.end = std::max(nr.end, w + 1);
+      }
+    }
+    if (nr.begin >= nr.end) nr = {0, 0};
+    for (unsigned w = r.begin; w < r.end; ++w) AndWord(set, w, kept[w]);
+    if (clear) ClearKept();
+    if ((nr.begin != r.begin) || (nr.end != r.end)) {
+      ranges_trail.push_back({set, r});
+      ranges[set] = nr;
+    }
+  }
+
+  void ClearKept() {
+    for (unsigned w : kept_words) kept[w] = 0;
+    kept_words.clear();
+  }
+
+  template <class TCallback>
+  void ForEach(unsigned set, TCallback f) const {
+    const TWord* p = &words[size_t(set) * nwords];
+    for (unsigned w = ranges[set].begin; w < ranges[set].end; ++w) {
+      for (TWord m = p[w]; m; m &= m - 1)
+        f(w * bits_per_word + __builtin_ctzll(m));
+    }
+  }
+
+  // Smallest bit >= bit in the set, Bits() if there is none.
+  unsigned Next(unsigned set, unsigned bit) const {
+    const TWord* p = &words[size_t(set) * nwords];
+    unsigned w = std::max(bit / bits_per_word, ranges[set].begin);
+    if (w >= ranges[set].end) return nbits;
+    TWord m = p[w];
+    if (w == bit / bits_per_word) m &= ~TWord(0) << (bit % bits_per_word);
+    for (; !m; m = p[w]) {
+      if (++w >= ranges[set].end) return nbits;
+    }
+    return w * bits_per_word + __builtin_ctzll(m);
+  }
+
+  void Mark() { marks.push_back({trail.size(), ranges_trail.size()}); }
+
+  // Reverts all changes since the last Mark() and removes it.
+  void Undo() {
+    assert(!marks.empty());
+    Rollback(marks.back().first, marks.back().second);
+    marks.pop_back();
+  }
+
+  // Reverts all changes since Init().
+  void Reset() {
+    Rollback(0, 0);
+    marks.clear();
+  }
+
+  size_t MemoryUsage() const {
+    return words.capacity() * sizeof(TWord) +
+           trail.capacity() * sizeof(Change) +
+           ranges_trail.capacity() * sizeof(RangeChange) +
+           sizes.capacity() * (sizeof(unsigned) + sizeof(Range)) +
+           kept.capacity() * sizeof(TWord);
+  }
+
+ protected:
+  void Rollback(size_t trail_size, size_t ranges_trail_size) {
+    for (; trail.size() > trail_size; trail.pop_back()) {
+      const Change& c = trail.back();
+      sizes[c.word / nwords] += __builtin_popcountll(c.old ^ words[c.word]);
+      words[c.word] = c.old;
+    }
+    for (; ranges_trail.size() > ranges_trail_size; ranges_trail.pop_back())
+      ranges[ranges_trail.back().set] = ranges_trail.back().old;
+  }
+};
+}  // namespace ds
@@ -6,25 +6,23 @@
 #include "common/geometry/d2/segment.h"
 #include "common/geometry/d2/location/location.h"
 #include "common/geometry/d2/utils/has_point_segment.h"
-#include "common/geometry/d2/utils/intersect_segment.h"
 
 namespace geometry {
 namespace d2 {
 namespace location {
+// Crossings of the horizontal ray from p to the right, with every edge
+// taken as half-open in y so that vertices on the ray are counted once.
 inline Location Locate(const I2Point& p, const I2Polygon& plgn) {
-  unsigned cnt = 0;
-  if (p == plgn[0]) return {Location::VERTEX, 0};
-  I2OpenSegment s0(p, {p.x, plgn[0].y - 1});
+  bool inside = false;
   for (unsigned i = 0; i < plgn.Size(); ++i) {
-    auto p1 = plgn[i], p2 = plgn.MGet(i+1);
-    if (p2 == p) return {Location::VERTEX, i + 1};
-    I2OpenSegment s(p1, p2);
-    if (HasPoint(s, p)) return {Location::EDGE, i};
-    if (Intersect(s0, s)) ++cnt;
-    if ((p1.x == p.x) && (p1.y < p.y) && (p2.x < p.x)) ++cnt;
-    if ((p2.x == p.x) && (p1.y < p.y) && (p1.x < p.x)) ++cnt;
+    auto p1 = plgn[i], p2 = plgn.MGet(i + 1);
+    if (p1 == p) return {Location::VERTEX, i};
+    if (HasPoint(I2OpenSegment(p1, p2), p)) return {Location::EDGE, i};
+    if ((p1.y > p.y) != (p2.y > p.y)) {
+      if (((p1 - p) % (p2 - p) > 0) == (p2.y > p1.y)) inside = !inside;
+    }
   }
-  return {(cnt % 2) ? Location::INSIDE : Location::OUTSIDE, 0};
+  return {inside ? Location::INSIDE : Location::OUTSIDE, 0};
 }
 }  // namespace location
 }  // namespace d2
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common/base.h"
+#include "common/geometry/d2/circle_int.h"
+#include "common/geometry/d2/point.h"
+#include "common/icfpc2021/lattice_index.h"
+#include "common/numeric/utils/usqrt.h"
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Lattice offsets (dx, dy) with lo <= dx^2 + dy^2 <= hi, i.e. the cells a
+// vertex can take relative to a placed neighbour along an edge with squared
+// length range [lo, hi]. Edges with the same range share one table, and
+// candidates are enumerated as neighbour + offset, so the cost is the size of
+// the ring instead of the size of the hole.
+class AnnulusTable {
+ public:
+  using TOffsets = std::vector<I2Point>;
+
+ protected:
+  std::map<std::pair<int64_t, int64_t>, unsigned> classes;
+  std::vector<TOffsets> tables;
+
+ public:
+  static TOffsets Build(int64_t lo, int64_t hi) {
+    TOffsets offsets;
+    if (hi < std::max<int64_t>(lo, 0)) return offsets;
+    const I2Point o(0, 0);
+    I2Circle outer(o, USqrt(hi), hi), inner(o, 0, lo - 1);
+    for (int64_t dx = -outer.r; dx <= outer.r; ++dx) {
+      const int64_t ymax = USqrt(hi - dx * dx);
+      const int64_t ymin =
+          (lo - 1 - dx * dx < 0) ? 0 : USqrt(lo - 1 - dx * dx) + 1;
+      for (int64_t dy = ymin; dy <= ymax; ++dy) {
+        I2Point p(dx, dy), q(dx, -dy);
+        assert(outer.Inside(p) && !inner.Inside(p));
+        offsets.push_back(p);
+        if (dy) offsets.push_back(q);
+      }
+    }
+    return offsets;
+  }
+
+  void Clear() {
+    classes.clear();
+    tables.clear();
+  }
+
+  // Class of the range [lo, hi], built on first use.
+  unsigned Add(int64_t lo, int64_t hi) {
+    auto it = classes.find({lo, hi});
+    if (it != classes.end()) return it->second;
+    unsigned c = unsigned(tables.size());
+    classes[{lo, hi}] = c;
+    tables.push_back(Build(lo, hi));
+    return c;
+  }
+
+  unsigned Classes() const { return unsigned(tables.size()); }
+  const TOffsets& Get(unsigned c) const { return tables[c]; }
+  size_t Size(unsigned c) const { return tables[c].size(); }
+
+  // Calls f(index) for every valid point at an offset of class c from center.
+  template <class TCallback>
+  void ForEach(const LatticeIndex& index, const I2Point& center, unsigned c,
+               TCallback f) const {
+    for (auto& d : tables[c]) {
+      int i = index.Get(center.x + d.x, center.y + d.y);
+      if (i != LatticeIndex::invalid) f(unsigned(i));
+    }
+  }
+};
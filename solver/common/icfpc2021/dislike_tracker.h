@@ -0,0 +1,119 @@
+#pragma once
+
+#include "common/base.h"
+
+#include <algorithm>
+#include <vector>
+
+// Dislike (sum over hole vertices of the squared distance to the closest
+// figure vertex) maintained under single-vertex moves. For every hole vertex
+// the two closest figure vertices are kept, so a move costs O(H) unless it
+// pushes away one of them, and leave-one-out queries need no rescan.
+// The hole is referenced, not copied, and must outlive the tracker.
+template <class TPoint>
+class DislikeTracker {
+ public:
+  static constexpr int64_t inf = (1ll << 60);
+
+ protected:
+  struct Nearest {
+    int64_t d;
+    int v;
+  };
+
+  const std::vector<TPoint>* hole = nullptr;
+  std::vector<TPoint> vertices;
+  std::vector<Nearest> first, second;
+  int64_t score = 0;
+
+ public:
+  static int64_t Distance(const TPoint& a, const TPoint& b) {
+    int64_t dx = int64_t(a.x) - int64_t(b.x), dy = int64_t(a.y) - int64_t(b.y);
+    return dx * dx + dy * dy;
+  }
+
+  void Init(const std::vector<TPoint>& _hole,
+            const std::vector<TPoint>& _vertices) {
+    hole = &_hole;
+    vertices = _vertices;
+    first.resize(hole->size());
+    second.resize(hole->size());
+    score = 0;
+    for (unsigned h = 0; h < hole->size(); ++h) {
+      Rescan(h);
+      score += first[h].d;
+    }
+  }
+
+  int64_t Score() const { return score; }
+  const TPoint& Vertex(unsigned v) const { return vertices[v]; }
+  int64_t NearestDistance(unsigned h) const { return first[h].d; }
+  int NearestVertex(unsigned h) const { return first[h].v; }
+
+  // Distance from hole vertex h to the closest figure vertex other than v.
+  int64_t DistanceWithout(unsigned h, unsigned v) const {
+    return (first[h].v == int(v)) ? second[h].d : first[h].d;
+  }
+
+  int64_t ScoreWithout(unsigned v) const {
+    int64_t s = 0;
+    for (unsigned h = 0; h < hole->size(); ++h) s += DistanceWithout(h, v);
+    return s;
+  }
+
+  // Score after Move(v, p), without moving.
+  int64_t ScoreIfMoved(unsigned v, const TPoint& p) const {
+    int64_t s = 0;
+    for (unsigned h = 0; h < hole->size(); ++h)
+      s += std::min(DistanceWithout(h, v), Distance((*hole)[h], p));
+    return s;
+  }
+
+  void Move(unsigned v, const TPoint& p) {
+    vertices[v] = p;
+    const int iv = int(v);
+    for (unsigned h = 0; h < hole->size(); ++h) {
+      const int64_t old = first[h].d;
+      const Nearest n{Distance((*hole)[h], p), iv};
+      Nearest &f = first[h], &s = second[h];
+      if (f.v == iv) {
+        if (n.d <= s.d) {
+          f = n;
+        } else {
+          Rescan(h);
+        }
+      } else if (s.v == iv) {
+        if (n.d <= f.d) {
+          s = f;
+          f = n;
+        } else if (n.d <= s.d) {
+          s = n;
+        } else {
+          Rescan(h);
+        }
+      } else if (n.d <= f.d) {
+        s = f;
+        f = n;
+      } else if (n.d < s.d) {
+        s = n;
+      }
+      score += first[h].d - old;
+    }
+  }
+
+ protected:
+  void Rescan(unsigned h) {
+    Nearest f{inf, -1}, s{inf, -1};
+    for (unsigned i = 0; i < vertices.size(); ++i) {
+      const Nearest n{Distance((*hole)[h], vertices[i]), int(i)};
+      if (n.d < f.d) {
+        s = f;
+        f = n;
+      } else if (n.d < s.d) {
+        s = n;
+      }
+    }
+    first[h] = f;
+    second[h] = s;
+  }
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "common/base.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+// Dense index of valid lattice points inside an axis-aligned box.
+// Point -> index is one array lookup. Nearest() returns the valid point
+// closest in L2 to any query: inside the box it is read from an exact
+// Euclidean distance transform, outside the box only the frontier of the
+// valid set (points with an invalid 4-neighbour) can be nearest, so only the
+// frontier is scanned.
+class LatticeIndex {
+ public:
+  static constexpr int invalid = -1;
+
+ protected:
+  int64_t x0 = 0, y0 = 0;
+  unsigned width = 0, height = 0;
+  std::vector<int64_t> vx, vy;
+  std::vector<int> index;
+  std::vector<int> nearest;
+  std::vector<int> frontier;
+
+ public:
+  void Init(int64_t min_x, int64_t min_y, int64_t max_x, int64_t max_y) {
+    x0 = min_x;
+    y0 = min_y;
+    width = unsigned(max_x - min_x + 1);
+    height = unsigned(max_y - min_y + 1);
+    vx.clear();
+    vy.clear();
+    index.assign(Cells(), invalid);
+    nearest.clear();
+    frontier.clear();
+  }
+
+  // Points get consecutive indices in the order they are added.
+  int Add(int64_t x, int64_t y) {
+    int i = int(vx.size());
+    vx.push_back(x);
+    vy.push_back(y);
+    index[Cell(x, y)] = i;
+    return i;
+  }
+
+  // Call after the last Add, before Nearest.
+  void Build() {
+    BuildFrontier();
+    BuildDistanceTransform();
+  }
+
+  unsigned Size() const { return unsigned(vx.size()); }
+  unsigned Cells() const { return width * height; }
+
+  size_t MemoryUsage() const {
+    return (vx.capacity() + vy.capacity()) * sizeof(int64_t) +
+           (index.capacity() + nearest.capacity() + frontier.capacity()) *
+               sizeof(int);
+  }
+
+  bool InBox(int64_t x, int64_t y) const {
+    return (x >= x0) && (y >= y0) && (x < x0 + width) && (y < y0 + height);
+  }
+
+  unsigned Cell(int64_t x, int64_t y) const {
+    return unsigned((x - x0) + width * (y - y0));
+  }
+
+  int Get(int64_t x, int64_t y) const {
+    return InBox(x, y) ? index[Cell(x, y)] : invalid;
+  }
+
+  int Nearest(int64_t x, int64_t y) const {
+    if (vx.empty()) return invalid;
+    if (InBox(x, y)) return nearest[Cell(x, y)];
+    int best = invalid;
+    int64_t best_d = std::numeric_limits<int64_t>::max();
+    for (int i : frontier) {
+      int64_t dx = vx[i] - x, dy = vy[i] - y, d = dx * dx + dy * dy;
+      if (d < best_d) {
+        best_d = d;
+        best = i;
+      }
+    }
+    return best;
+  }
+
+ protected:
+  void BuildFrontier() {
+    static const int64_t dx[4] = {1, -1, 0, 0}, dy[4] = {0, 0, 1, -1};
+    for (unsigned i = 0; i < Size(); ++i) {
+      for (unsigned k = 0; k < 4; ++k) {
+        if (Get(vx[i] + dx[k], vy[i] + dy[k]) == invalid) {
+          frontier.push_back(i);
+          break;
+        }
+      }
+    }
+  }
+
+  // Felzenszwalb-Huttenlocher: nearest valid cell along every column, then
+  // the lower envelope of parabolas along every row.
+  void BuildDistanceTransform() {
+    const int64_t inf = std::numeric_limits<int64_t>::max() / 4;
+    std::vector<int64_t> column_y(Cells(), inf);
+    for (unsigned x = 0; x < width; ++x) {
+      int64_t last = inf;
+      for (unsigned y = 0; y < height; ++y) {
+        if (index[x + width * y] != invalid) last = y;
+        column_y[x + width * y] = last;
+      }
+      last = inf;
+      for (unsigned y = height; y-- > 0;) {
+        if (index[x + width * y] != invalid) last = y;
+        int64_t& c = column_y[x + width * y];
+        if ((last != inf) && ((c == inf) || (last - int64_t(y) < int64_t(y) - c))) c = last;
+      }
+    }
+    nearest.assign(Cells(), invalid);
+    std::vector<int64_t> f(width);
+    std::vector<unsigned> v(width);
+    std::vector<double> z(width + 1);
+    for (unsigned y = 0; y < height; ++y) {
+      unsigned k = 0;
+      bool any = false;
+      for (unsigned x = 0; x < width; ++x) {
+        int64_t c = column_y[x + width * y];
+        f[x] = (c == inf) ? inf : (c - y) * (c - y);
+        if (f[x] == inf) continue;
+        if (!any) {
+          any = true;
+          v[0] = x;
+          z[0] = -std::numeric_limits<double>::infinity();
+          z[1] = std::numeric_limits<double>::infinity();
+          continue;
+        }
+        for (;;) {
+          unsigned q = v[k];
+          double s = double((f[x] + int64_t(x) * x) - (f[q] + int64_t(q) * q)) / (2.0 * (int64_t(x) - q));
+          if ((s <= z[k]) && (k > 0)) {
+            --k;
+            continue;
+          }
+          ++k;
+          v[k] = x;
+          z[k] = s;
+          z[k + 1] = std::numeric_limits<double>::infinity();
+          break;
+        }
+      }
+      if (!any) continue;
+      k = 0;
+      for (unsigned x = 0; x < width; ++x) {
+        while (z[k + 1] < x) ++k;
+        unsigned q = v[k];
+        nearest[x + width * y] = index[q + width * column_y[q + width * y]];
+      }
+    }
+  }
+};
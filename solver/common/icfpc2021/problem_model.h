@@ -0,0 +1,247 @@
+#pragma once
+
+#include "common/base.h"
+#include "common/geometry/d2/axis/rectangle.h"
+#include "common/geometry/d2/distance/distance_l2.h"
+#include "common/geometry/d2/point.h"
+#include "common/geometry/d2/polygon.h"
+#include "common/geometry/d2/utils/box.h"
+#include "common/geometry/d2/utils/inside_point_polygon.h"
+#include "common/icfpc2021/lattice_index.h"
+#include "common/numeric/utils/usqrt.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Problem file compiled once into the layout both solver families use: the
+// figure as a CSR graph with integer bounds [lo, hi] on the squared length of
+// every edge, all-pairs reach bounds and the lattice points of the hole.
+// Immutable after Parse(), so Task, TaskCache and the MCMC Problem share one
+// instance through a shared_ptr.
+class ProblemModel {
+ public:
+  struct Arc {
+    unsigned to, edge;
+  };
+
+  // Lattice points inside the hole (boundary included), ordered by x, then
+  // by y; column_begin[x - box.p1.x] is the index of the first one in
+  // column x.
+  struct Lattice {
+    I2ARectangle box;
+    std::vector<I2Point> points;
+    LatticeIndex index;
+    std::vector<unsigned> column_begin;
+
+    size_t MemoryUsage() const {
+      return points.capacity() * sizeof(I2Point) + index.MemoryUsage() +
+             column_begin.capacity() * sizeof(unsigned);
+    }
+  };
+
+  // The figure in the interface of UndirectedGraphEI with {lo, hi} as edge
+  // info, read from the CSR arrays. Arcs of a vertex come in the order of
+  // the edges in the file, as AddEdge() would have added them.
+  class Graph {
+   public:
+    struct EdgeEI {
+      unsigned to;
+      std::pair<int64_t, int64_t> info;
+    };
+
+    class Iterator {
+     protected:
+      const ProblemModel* model;
+      const Arc* arc;
+
+     public:
+      Iterator(const ProblemModel* _model, const Arc* _arc)
+          : model(_model), arc(_arc) {}
+
+      EdgeEI operator*() const {
+        return {arc->to, {model->edge_lo[arc->edge], model->edge_hi[arc->edge]}};
+      }
+      Iterator& operator++() {
+        ++arc;
+        return *this;
+      }
+      bool operator!=(const Iterator& r) const { return arc != r.arc; }
+    };
+
+    class Edges {
+     protected:
+      Iterator b, e;
+
+     public:
+      Edges(const Iterator& _b, const Iterator& _e) : b(_b), e(_e) {}
+      Iterator begin() const { return b; }
+      Iterator end() const { return e; }
+    };
+
+   protected:
+    const ProblemModel* model = nullptr;
+
+   public:
+    Graph() {}
+    explicit Graph(const ProblemModel* _model) : model(_model) {}
+
+    unsigned Size() const { return model ? model->Vertices() : 0; }
+    unsigned EdgesSize() const { return model ? model->Edges() : 0; }
+    Edges EdgesEI(unsigned u) const {
+      return Edges(Iterator(model, model->ArcsBegin(u)),
+                   Iterator(model, model->ArcsEnd(u)));
+    }
+  };
+
+  static constexpr int64_t unreachable = (1ll << 30);
+
+  int eps = 0;  // In millionths
+  uint64_t source_hash = 0;  // FNV-1a of the file, as PrecomputeStore::hash
+  std::vector<I2Point> hole, vertices, bonuses;
+  std::vector<unsigned> edge_from, edge_to;
+  // d is allowed for edge e iff edge_lo[e] <= d <= edge_hi[e], which is
+  // exactly |d / d0 - 1| <= eps / 10^6.
+  std::vector<int64_t> edge_lo, edge_hi;
+  // Arcs of u are arcs[arcs_begin[u]] ... arcs[arcs_begin[u + 1] - 1], in
+  // the order of the edges in the file.
+  std::vector<unsigned> arcs_begin;
+  std::vector<Arc> arcs;
+  // Upper bound of the squared distance between two vertices in a valid
+  // placement: hi for edges, else the square of the shortest path with
+  // lengths ceil(sqrt(hi)); unreachable^2 for other components.
+  std::vector<int64_t> reach;
+
+ protected:
+  mutable std::once_flag lattice_flag;
+  mutable std::unique_ptr<Lattice> lattice;
+
+ public:
+  static std::shared_ptr<const ProblemModel> Parse(const std::string& raw) {
+    auto model = std::make_shared<ProblemModel>();
+    model->Build(raw);
+    return model;
+  }
+
+  static std::shared_ptr<const ProblemModel> Load(const std::string& filename) {
+    std::ifstream is(filename);
+    if (!is) {
+      std::cerr << "File " << filename << " not found." << std::endl;
+      throw std::runtime_error("missing problem file");
+    }
+    return Parse(std::string(std::istreambuf_iterator<char>(is),
+                             std::istreambuf_iterator<char>()));
+  }
+
+  unsigned Vertices() const { return unsigned(vertices.size()); }
+  unsigned Edges() const { return unsigned(edge_from.size()); }
+
+  const Arc* ArcsBegin(unsigned u) const { return arcs.data() + arcs_begin[u]; }
+  const Arc* ArcsEnd(unsigned u) const {
+    return arcs.data() + arcs_begin[u + 1];
+  }
+
+  // Valid while the model is alive.
+  Graph GetGraph() const { return Graph(this); }
+
+  int64_t Reach(unsigned u, unsigned v) const {
+    return reach[size_t(u) * vertices.size() + v];
+  }
+
+  // Built on first use; the scheduler loads every problem but only a few
+  // of them are searched.
+  const Lattice& GetLattice() const {
+    std::call_once(lattice_flag, [this]() { BuildLattice(); });
+    return *lattice;
+  }
+
+ protected:
+  void Build(const std::string& raw) {
+    source_hash = 14695981039346656037ull;
+    for (unsigned char c : raw) {
+      source_hash ^= c;
+      source_hash *= 1099511628211ull;
+    }
+    auto json = nlohmann::json::parse(raw);
+    eps = json["epsilon"];
+    for (auto& p : json["hole"]) hole.push_back({p[0], p[1]});
+    auto& figure = json["figure"];
+    for (auto& p : figure["vertices"]) vertices.push_back({p[0], p[1]});
+    for (auto& b : json["bonuses"])
+      bonuses.push_back({b["position"][0], b["position"][1]});
+    unsigned n = Vertices();
+    arcs_begin.assign(n + 1, 0);
+    for (auto& e : figure["edges"]) {
+      unsigned u = e[0], v = e[1];
+      auto d = SquaredDistanceL2(vertices[u], vertices[v]);
+      auto dd = (d * eps) / 1000000;
+      edge_from.push_back(u);
+      edge_to.push_back(v);
+      edge_lo.push_back(d - dd);
+      edge_hi.push_back(d + dd);
+      ++arcs_begin[u + 1];
+      ++arcs_begin[v + 1];
+    }
+    for (unsigned u = 0; u < n; ++u) arcs_begin[u + 1] += arcs_begin[u];
+    arcs.resize(2 * Edges());
+    std::vector<unsigned> next(arcs_begin.begin(), arcs_begin.end() - 1);
+    for (unsigned e = 0; e < Edges(); ++e) {
+      arcs[next[edge_from[e]]++] = {edge_to[e], e};
+      arcs[next[edge_to[e]]++] = {edge_from[e], e};
+    }
+    BuildReach();
+  }
+
+  void BuildReach() {
+    const size_t n = vertices.size();
+    std::vector<int64_t> d(n * n, unreachable);
+    for (size_t u = 0; u < n; ++u) d[u * n + u] = 0;
+    for (unsigned e = 0; e < Edges(); ++e) {
+      int64_t l = USqrt(edge_hi[e] - 1) + 1;
+      size_t u = edge_from[e], v = edge_to[e];
+      d[u * n + v] = d[v * n + u] = std::min(d[u * n + v], l);
+    }
+    for (size_t k = 0; k < n; ++k) {
+      for (size_t i = 0; i < n; ++i) {
+        const int64_t dik = d[i * n + k];
+        if (dik >= unreachable) continue;
+        for (size_t j = 0; j < n; ++j)
+          d[i * n + j] = std::min(d[i * n + j], dik + d[k * n + j]);
+      }
+    }
+    reach.resize(n * n);
+    for (size_t k = 0; k < n * n; ++k) reach[k] = d[k] * d[k];
+    for (unsigned e = 0; e < Edges(); ++e) {
+      size_t u = edge_from[e], v = edge_to[e];
+      reach[u * n + v] = reach[v * n + u] = edge_hi[e];
+    }
+  }
+
+  void BuildLattice() const {
+    lattice = std::make_unique<Lattice>();
+    auto& l = *lattice;
+    I2Polygon polygon(hole);
+    l.box = Box(hole);
+    l.index.Init(l.box.p1.x, l.box.p1.y, l.box.p2.x, l.box.p2.y);
+    for (int64_t x = l.box.p1.x; x <= l.box.p2.x; ++x) {
+      l.column_begin.push_back(unsigned(l.points.size()));
+      for (int64_t y = l.box.p1.y; y <= l.box.p2.y; ++y) {
+        I2Point p(x, y);
+        if (geometry::d2::Inside(p, polygon)) {
+          l.index.Add(x, y);
+          l.points.push_back(p);
+        }
+      }
+    }
+    l.column_begin.push_back(unsigned(l.points.size()));
+    l.index.Build();
+  }
+};
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "common/base.h"
+#include "common/geometry/d2/base.h"
+#include "common/geometry/d2/compare/point_xy.h"
+#include "common/geometry/d2/distance/distance_l2.h"
+#include "common/geometry/d2/point.h"
+#include "common/geometry/d2/polygon.h"
+#include "common/geometry/d2/segment.h"
+#include "common/geometry/d2/utils/box.h"
+#include "common/geometry/d2/utils/inside_segment_polygon.h"
+#include "common/geometry/d2/utils/rotate_pi4s_points.h"
+#include "common/geometry/d2/vector.h"
+#include "common/icfpc2021/annulus.h"
+#include "common/icfpc2021/problem_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+// Placements of the whole figure as a rigid body: one of the 8 lattice
+// symmetries (optionally composed with the pi/4 rotation of RotatePi4S)
+// followed by a translation. The hole interior is kept as one bitmap row per
+// y, so the translations that put every vertex on a valid point are found
+// for a whole row at once by ANDing the rows of the vertices, shifted by
+// their x. Only these translations get the exact segment checks.
+//
+// SearchRotations() covers other angles: the longest edge must end up as a
+// lattice vector w with a valid length, so every such w (for the figure and
+// its mirror image) gives a rotation, and the rotated vertices are snapped to
+// the nearest lattice points; snapped figures that keep all edge lengths
+// within eps go through the same translation search.
+class RigidPlacement {
+ public:
+  using TWord = uint64_t;
+  static const unsigned bits_per_word = 64;
+
+ protected:
+  std::shared_ptr<const ProblemModel> model;
+  I2Polygon hole;
+  I2ARectangle box;
+  unsigned row_words;
+  // Bit x - box.p1.x of rows[(y - box.p1.y) * row_words] is set iff (x, y)
+  // is in the hole; every row ends with a zero word for shifted reads.
+  std::vector<TWord> rows;
+  std::vector<TWord> mask;
+
+ public:
+  explicit RigidPlacement(std::shared_ptr<const ProblemModel> _model)
+      : model(_model), hole(model->hole) {
+    auto& lattice = model->GetLattice();
+    box = lattice.box;
+    row_words = unsigned((box.p2.x - box.p1.x + 1) / bits_per_word) + 2;
+    rows.assign(size_t(box.p2.y - box.p1.y + 1) * row_words, 0);
+    for (auto& p : lattice.points) {
+      unsigned b = unsigned(p.x - box.p1.x);
+      rows[size_t(p.y - box.p1.y) * row_words + b / bits_per_word] |=
+          TWord(1) << (b % bits_per_word);
+    }
+  }
+
+  // Images of the figure under the 8 symmetries of the lattice, and under
+  // their compositions with RotatePi4S if pi4 is set.
+  static std::vector<std::vector<I2Point>> Orientations(
+      const std::vector<I2Point>& vertices, bool pi4) {
+    std::vector<std::vector<I2Point>> output;
+    for (unsigned k = 0; k < 8; ++k) {
+      std::vector<I2Point> v(vertices);
+      for (auto& p : v) {
+        if (k & 1) p.x = -p.x;
+        if (k & 2) p.y = -p.y;
+        if (k & 4) std::swap(p.x, p.y);
+      }
+      output.push_back(v);
+      if (pi4) output.push_back(RotatePi4S(v));
+    }
+    return output;
+  }
+
+  // Edge lengths do not depend on the translation.
+  bool ValidLengths(const std::vector<I2Point>& v) const {
+    for (unsigned e = 0; e < model->Edges(); ++e) {
+      auto d = SquaredDistanceL2(v[model->edge_from[e]], v[model->edge_to[e]]);
+      if ((d < model->edge_lo[e]) || (d > model->edge_hi[e])) return false;
+    }
+    return true;
+  }
+
+  bool ValidSegments(const std::vector<I2Point>& v, const I2Vector& t) const {
+    for (unsigned e = 0; e < model->Edges(); ++e) {
+      if (!geometry::d2::Inside(I2ClosedSegment(v[model->edge_from[e]] + t,
+                                                v[model->edge_to[e]] + t),
+                                hole))
+        return false;
+    }
+    return true;
+  }
+
+  // Calls f(t) for every translation t that moves all points of v to valid
+  // points, until f returns true; returns true if it did.
+  template <class TCallback>
+  bool ForEachTranslation(const std::vector<I2Point>& v, TCallback f) {
+    if (v.empty()) return false;
+    auto vbox = Box(v);
+    const int64_t tx0 = box.p1.x - vbox.p1.x, tx1 = box.p2.x - vbox.p2.x;
+    const int64_t ty0 = box.p1.y - vbox.p1.y, ty1 = box.p2.y - vbox.p2.y;
+    if ((tx0 > tx1) || (ty0 > ty1)) return false;
+    // Distinct points, the farthest from the center first: they empty the
+    // rows soonest.
+    std::vector<I2Point> points(v);
+    std::sort(points.begin(), points.end(), CompareXY<int64_t>);
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    const I2Point c((vbox.p1.x + vbox.p2.x) / 2, (vbox.p1.y + vbox.p2.y) / 2);
+    std::stable_sort(points.begin(), points.end(),
+                     [&](const I2Point& a, const I2Point& b) {
+                       return SquaredDistanceL2(a, c) > SquaredDistanceL2(b, c);
+                     });
+    const unsigned nbits = unsigned(tx1 - tx0 + 1);
+    const unsigned nwords = (nbits + bits_per_word - 1) / bits_per_word;
+    mask.resize(nwords);
+    for (int64_t ty = ty0; ty <= ty1; ++ty) {
+      std::fill(mask.begin(), mask.end(), ~TWord(0));
+      if (nbits % bits_per_word)
+        mask.back() = (TWord(1) << (nbits % bits_per_word)) - 1;
+      bool empty = false;
+      for (auto& p : points) {
+        const TWord* row = &rows[size_t(p.y + ty - box.p1.y) * row_words];
+        const unsigned shift = unsigned(p.x - vbox.p1.x);
+        const unsigned w0 = shift / bits_per_word, r = shift % bits_per_word;
+        TWord any = 0;
+        for (unsigned w = 0; w < nwords; ++w) {
+          TWord bits = row[w0 + w] >> r;
+          if (r) bits |= row[w0 + w + 1] << (bits_per_word - r);
+          any |= (mask[w] &= bits);
+        }
+        if (!any) {
+          empty = true;
+          break;
+        }
+      }
+      if (empty) continue;
+      for (unsigned w = 0; w < nwords; ++w) {
+        for (TWord m = mask[w]; m; m &= m - 1) {
+          I2Vector t(tx0 + w * bits_per_word + __builtin_ctzll(m), ty);
+          if (f(t)) return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Calls f(v) for the snapped image of the figure under the rotation for
+  // every candidate w of the longest edge, mirrored or not, until f returns
+  // true; returns true if it did.
+  template <class TCallback>
+  bool ForEachRotation(TCallback f) const {
+    if (model->Edges() == 0) return false;
+    unsigned e = 0;
+    for (unsigned k = 1; k < model->Edges(); ++k) {
+      if (model->edge_hi[k] > model->edge_hi[e]) e = k;
+    }
+    const unsigned a = model->edge_from[e], b = model->edge_to[e];
+    std::vector<I2Point> base(model->vertices), v(base.size());
+    for (unsigned mirror = 0; mirror < 2; ++mirror) {
+      if (mirror) {
+        for (auto& p : base) p.x = -p.x;
+      }
+      const double angle0 = atan2(double(base[b].y - base[a].y),
+                                  double(base[b].x - base[a].x));
+      for (auto& w : AnnulusTable::Build(model->edge_lo[e], model->edge_hi[e])) {
+        const double angle = atan2(double(w.y), double(w.x)) - angle0;
+        const double c = cos(angle), s = sin(angle);
+        for (unsigned i = 0; i < base.size(); ++i) {
+          const double dx = double(base[i].x - base[a].x),
+                       dy = double(base[i].y - base[a].y);
+          v[i] = I2Point(std::llround(c * dx - s * dy),
+                         std::llround(s * dx + c * dy));
+        }
+        if (f(v)) return true;
+      }
+    }
+    return false;
+  }
+
+  // First valid placement over all snapped rotations; false if there is
+  // none.
+  bool SearchRotations(std::vector<I2Point>& solution) {
+    return ForEachRotation([&](const std::vector<I2Point>& v) {
+      if (!ValidLengths(v)) return false;
+      return ForEachTranslation(v, [&](const I2Vector& t) {
+        if (!ValidSegments(v, t)) return false;
+        solution = v;
+        for (auto& p : solution) p += t;
+        return true;
+      });
+    });
+  }
+
+  // First valid placement over all orientations; false if there is none.
+  bool Search(std::vector<I2Point>& solution, bool pi4 = true) {
+    for (auto& v : Orientations(model->vertices, pi4)) {
+      if (!ValidLengths(v)) continue;
+      bool found = ForEachTranslation(v, [&](const I2Vector& t) {
+        if (!ValidSegments(v, t)) return false;
+        solution = v;
+        for (auto& p : solution) p += t;
+        return true;
+      });
+      if (found) return true;
+    }
+    return false;
+  }
+};
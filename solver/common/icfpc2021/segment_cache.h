@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common/base.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+// Fixed-size 4-way set-associative cache for a symmetric boolean function of
+// two lattice indices (validity of the segment between two valid points).
+// Every slot is a single atomic word holding key and value, so any number of
+// threads can share the cache without locks; a lost race only costs one more
+// evaluation. Hit and miss counts are kept per thread stripe, each on its own
+// cache line, and summed when read.
+class SegmentCache {
+ public:
+  static const unsigned ways = 4;
+  static const unsigned default_max_log_slots = 22;  // 32 MB
+  static const unsigned stripes = 64;
+
+ protected:
+  struct alignas(64) Counters {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+  };
+
+  unsigned log_sets;
+  std::unique_ptr<std::atomic<uint64_t>[]> slots;
+  std::unique_ptr<Counters[]> counters;
+
+  // Threads take stripes round-robin on first use.
+  static unsigned Stripe() {
+    static std::atomic<unsigned> next(0);
+    thread_local unsigned stripe =
+        next.fetch_add(1, std::memory_order_relaxed) % stripes;
+    return stripe;
+  }
+
+ public:
+  // Sized for all pairs of nindices indices, but not above 2^max_log_slots.
+  explicit SegmentCache(unsigned nindices,
+                        unsigned max_log_slots = default_max_log_slots)
+      : counters(new Counters[stripes]) {
+    unsigned log_slots = LogSlots(nindices, max_log_slots);
+    log_sets = log_slots - 2;
+    slots.reset(new std::atomic<uint64_t>[size_t(1) << log_slots]);
+    for (size_t k = 0; k < (size_t(1) << log_slots); ++k) slots[k] = 0;
+  }
+
+  template <class TCompute>
+  bool Get(unsigned i, unsigned j, TCompute compute) {
+    if (i > j) std::swap(i, j);
+    const uint64_t key = ((uint64_t(i) << 31) | j) + 1;
+    const uint64_t h = key * 0x9E3779B97F4A7C15ull;
+    std::atomic<uint64_t>* set = &slots[(log_sets ? (h >> (64 - log_sets)) : 0) * ways];
+    Counters& c = counters[Stripe()];
+    for (unsigned w = 0; w < ways; ++w) {
+      uint64_t s = set[w].load(std::memory_order_relaxed);
+      if ((s >> 1) == key) {
+        c.hits.fetch_add(1, std::memory_order_relaxed);
+        return s & 1;
+      }
+    }
+    bool value = compute();
+    uint64_t n = c.misses.fetch_add(1, std::memory_order_relaxed);
+    set[n % ways].store((key << 1) | (value ? 1 : 0), std::memory_order_relaxed);
+    return value;
+  }
+
+  static unsigned LogSlots(unsigned nindices,
+                           unsigned max_log_slots = default_max_log_slots) {
+    uint64_t pairs = uint64_t(nindices) * (nindices + 1) / 2;
+    unsigned log_slots = 2;
+    for (; (log_slots < max_log_slots) && ((1ull << log_slots) < pairs);)
+      ++log_slots;
+    return log_slots;
+  }
+
+  // MemoryUsage() of a cache for nindices indices, without building it.
+  static size_t EstimateMemoryUsage(
+      unsigned nindices, unsigned max_log_slots = default_max_log_slots) {
+    return (size_t(1) << LogSlots(nindices, max_log_slots)) * sizeof(uint64_t) +
+           stripes * sizeof(Counters);
+  }
+
+  uint64_t Hits() const {
+    uint64_t total = 0;
+    for (unsigned k = 0; k < stripes; ++k) total += counters[k].hits;
+    return total;
+  }
+
+  uint64_t Misses() const {
+    uint64_t total = 0;
+    for (unsigned k = 0; k < stripes; ++k) total += counters[k].misses;
+    return total;
+  }
+
+  size_t MemoryUsage() const {
+    return (size_t(1) << (log_sets + 2)) * sizeof(uint64_t) +
+           stripes * sizeof(Counters);
+  }
+};
@@ -1,71 +1,194 @@
 #pragma once
 
 #include "common/geometry/d2/point.h"
+#include "common/icfpc2021/solver/parallel_search.h"
 #include "common/icfpc2021/solver/perfect_score.h"
 #include "common/icfpc2021/solution.h"
 #include "common/icfpc2021/task.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 namespace solver {
+// PerfectScore for every subset of the bonuses, with the bonus points as
+// extra vertexes to cover. Solutions of a subset are solutions of all its
+// subsets, so a subset is searched only after all its parents (the subsets
+// with one bonus less) are solved, and an infeasible subset makes all its
+// supersets infeasible at once. Independent subsets run on separate threads.
+// A search starts from its parents: their first cover steps that failed are
+// removed from the domains, and the positions of a parent solution are tried
+// first; if that solution already covers the new bonus, it is reused as is.
 class BonusHunting : public PerfectScore {
  public:
   using TBase = PerfectScore;
 
  protected:
+  enum class State { pending, running, solved, infeasible };
+
+  struct Subset {
+    State state = State::pending;
+    std::vector<I2Point> solution;
+    TPath failed_first_steps;
+  };
+
   unsigned task_id;
+  unsigned threads;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<Subset> subsets;
 
  public:
-  BonusHunting(const Task& _task, unsigned _task_id) : PerfectScore(_task), task_id(_task_id) {}
+  BonusHunting(const Task& _task, unsigned _task_id, unsigned _threads = 1)
+      : PerfectScore(_task), task_id(_task_id), threads(_threads) {}
 
-  void Search() {
-    unsigned n = task.bonuses_to_unlock.size(), p2n = (1u << n);
-    std::vector<unsigned> vf(p2n, 0);
+ protected:
+  // Hole vertexes and the bonuses of mask i.
+  std::vector<I2Point> Targets(unsigned i) const {
     std::vector<I2Point> vt = task.hole.v;
-    for (unsigned i = 0; i < p2n; ++i) {
-      vt.resize(task.hole.Size());
-      bool b;
-      if (i == 0) {
-        TBase::ResetSearch(vt);
-        std::cout << "Solving T" << task_id << " with BM = " << i << std::endl;
-        b = TBase::Search();
-        std::cout << "Done. " << b << std::endl;
-        vf[i] = b;
-      } else {
-        unsigned j = 0;
-        for (; (i & (1u << j)) == 0;) ++j;
-        unsigned ia = i ^ (1u << j);
-        if (!vf[ia]) continue; // No solution for subset
-        for (; (1u << j) <= i; ++j) {
-          if (i & (1u << j)) {
-            I2Point pnew = task.bonuses_to_unlock[j];
-            bool duplicate = false;
-            for (auto p : vt) {
-              if (p == pnew) {
-                duplicate = true;
-                break;
-              }
-            }
-            if (!duplicate) {
-              vt.push_back(pnew);
-            }
-          }
+    for (unsigned j = 0; (1u << j) <= i; ++j) {
+      if ((i & (1u << j)) == 0) continue;
+      I2Point pnew = task.bonuses_to_unlock[j];
+      if (std::find(vt.begin(), vt.end(), pnew) == vt.end()) vt.push_back(pnew);
+    }
+    return vt;
+  }
+
+  static bool Covers(const std::vector<I2Point>& solution,
+                     const std::vector<I2Point>& vt) {
+    for (auto& p : vt) {
+      if (std::find(solution.begin(), solution.end(), p) == solution.end())
+        return false;
+    }
+    return true;
+  }
+
+  bool SearchSubset() {
+    if (threads <= 1) return TBase::Search();
+    ParallelSearch<PerfectScore> parallel(*this, threads);
+    if (!parallel.Search()) return false;
+    solution = parallel.GetSolution();
+    return true;
+  }
+
+  // Requires mutex. Next subset whose parents are all solved, p2n if none
+  // is ready yet.
+  unsigned NextReady() const {
+    unsigned p2n = unsigned(subsets.size());
+    for (unsigned i = 1; i < p2n; ++i) {
+      if (subsets[i].state != State::pending) continue;
+      bool ready = true;
+      for (unsigned j = 0; ready && (1u << j) <= i; ++j) {
+        if (i & (1u << j))
+          ready = (subsets[i ^ (1u << j)].state == State::solved);
+      }
+      if (ready) return i;
+    }
+    return p2n;
+  }
+
+  // Requires mutex.
+  bool AllDone() const {
+    for (auto& s : subsets) {
+      if ((s.state == State::pending) || (s.state == State::running))
+        return false;
+    }
+    return true;
+  }
+
+  // Requires mutex.
+  void Finish(unsigned i, bool found, const std::vector<I2Point>& v,
+              const TPath& failed) {
+    auto& s = subsets[i];
+    std::cout << "Done T" << task_id << " with BM = " << i << ". " << found << std::endl;
+    s.failed_first_steps = failed;
+    if (found) {
+      s.state = State::solved;
+      s.solution = v;
+      Solution sol{v};
+      auto filename = "solutions/soptimal/" + std::to_string(task_id) + (i ? "_" + std::to_string(i) : "")  + ".json";
+      std::ofstream of(filename);
+      of << sol.ToJson();
+    } else {
+      s.state = State::infeasible;
+      for (unsigned k = i + 1; k < subsets.size(); ++k) {
+        if (((k & i) == i) && (subsets[k].state == State::pending))
+          subsets[k].state = State::infeasible;
+      }
+    }
+    changed.notify_all();
+  }
+
+  // Searches subset i on search, warm-started from its parents.
+  void SolveSubset(PerfectScore& search, unsigned i) {
+    auto vt = Targets(i);
+    std::vector<I2Point> hint;
+    TPath excluded;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (unsigned j = 0; (1u << j) <= i; ++j) {
+        if ((i & (1u << j)) == 0) continue;
+        auto& parent = subsets[i ^ (1u << j)];
+        if (hint.empty()) hint = parent.solution;
+        if (Covers(parent.solution, vt)) {
+          std::cout << "Solution of BM = " << (i ^ (1u << j)) << " covers BM = " << i << std::endl;
+          Finish(i, true, parent.solution, parent.failed_first_steps);
+          return;
         }
-        TBase::ResetSearch(vt);
-        std::cout << "Solving T" << task_id << " with BM = " << i << std::endl;
-        b = TBase::Search();
-        std::cout << "Done. " << b << std::endl;
-        vf[i] = b;
+        excluded.insert(excluded.end(), parent.failed_first_steps.begin(),
+                        parent.failed_first_steps.end());
       }
-      if (b) {
-        auto v = GetSolution();
-        Solution s{v};
-        auto js = s.ToJson();
-        auto filename = "solutions/soptimal/" + std::to_string(task_id) + (i ? "_" + std::to_string(i) : "")  + ".json";
-        std::ofstream of(filename);
-        of << js;
+    }
+    std::cout << "Solving T" << task_id << " with BM = " << i << std::endl;
+    search.ResetSearch(vt);
+    search.Exclude(excluded);
+    search.SetHint(hint);
+    bool found = search.Search();
+    // Steps excluded from the start failed for this subset as well.
+    TPath failed = search.FailedFirstSteps();
+    failed.insert(failed.end(), excluded.begin(), excluded.end());
+    std::lock_guard<std::mutex> lock(mutex);
+    Finish(i, found, search.GetSolution(), failed);
+  }
+
+  void Work() {
+    PerfectScore search(*this);
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      unsigned i = NextReady();
+      if (i < subsets.size()) {
+        subsets[i].state = State::running;
+        lock.unlock();
+        SolveSubset(search, i);
+        lock.lock();
+      } else if (AllDone()) {
+        break;
+      } else {
+        changed.wait(lock);
       }
     }
   }
+
+ public:
+  void Search() {
+    unsigned n = task.bonuses_to_unlock.size(), p2n = (1u << n);
+    subsets.assign(p2n, Subset());
+    TBase::ResetSearch(Targets(0));
+    std::cout << "Solving T" << task_id << " with BM = " << 0 << std::endl;
+    bool b = SearchSubset();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      Finish(0, b, GetSolution(), FailedFirstSteps());
+    }
+    std::vector<std::thread> pool;
+    for (unsigned k = 0; k < std::min(std::max(threads, 1u), p2n - 1); ++k)
+      pool.emplace_back(&BonusHunting::Work, this);
+    for (auto& t : pool) t.join();
+  }
 };
 }  // namespace solver
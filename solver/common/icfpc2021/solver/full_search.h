@@ -1,12 +1,17 @@
 #pragma once
 
+#include "common/data_structures/bitset_domains.h"
 #include "common/data_structures/unsigned_set.h"
 #include "common/geometry/d2/distance/distance_l2.h"
 #include "common/geometry/d2/point.h"
+#include "common/geometry/d2/utils/box.h"
 #include "common/icfpc2021/task.h"
 #include "common/icfpc2021/task_cache.h"
+#include "common/numeric/utils/usqrt.h"
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <random>
 #include <vector>
 
@@ -14,15 +19,45 @@
 
 namespace solver {
 class FullSearch {
+ public:
+  // A decision of the search, see ParallelSearch.
+  struct Step {
+    unsigned vertex;
+    I2Point p;
+    int cover;  // Hole vertex covered by p in PerfectScore, -1 otherwise
+  };
+  using TPath = std::vector<Step>;
+  using TSplit = std::function<void(TPath&&)>;
+
  protected:
   std::default_random_engine re;
   Task task;
   TaskCache cache;
   ds::UnsignedSet used_vertices;
-  std::vector<std::vector<std::vector<I2Point>>> valid_candidates;
-  std::vector<unsigned> valid_candidates_index;
+  // Candidates of every vertex as indices of cache.GetValidPoints().
+  ds::BitsetDomains domains;
   std::vector<I2Point> solution;
   bool force_stop;
+  // Propagation mode: after forward checking of the placed vertex, make all
+  // figure edges between unplaced vertices arc consistent (AC-3).
+  bool arc_consistency = false;
+  // Domains larger than this are assumed to support every neighbour value
+  // and are not used to revise neighbours.
+  unsigned max_support_size = 512;
+  ds::UnsignedSet queued;
+  std::vector<unsigned> queue;
+  std::vector<I2Point> support;
+  size_t nodes = 0;
+  size_t max_nodes = 0;  // 0 for no limit
+  // Position of every vertex in a known solution of a related task, tried
+  // first when the vertex is placed; empty for none.
+  std::vector<I2Point> hint;
+  // Parallel mode: decisions from the root, a flag that stops the search and
+  // a callback that takes open subtrees while some workers are idle.
+  TPath path;
+  const std::atomic<bool>* cancel = nullptr;
+  const std::atomic<unsigned>* idle_workers = nullptr;
+  TSplit split;
 
  public:
   FullSearch(const Task& _task) {
@@ -42,35 +77,65 @@ class FullSearch {
     unsigned size = task.g.Size();
     used_vertices.Resize(size);
     used_vertices.Clear();
-    valid_candidates.clear();
-    valid_candidates.resize(size);
-    for (unsigned i = 0; i < size; ++i) {
-      valid_candidates[i].resize(2 * size + 1); // For safety
-      valid_candidates[i][0] = cache.GetValidPoints();
-      std::shuffle(valid_candidates[i][0].begin(), valid_candidates[i][0].end(), re);
-    }
-    valid_candidates_index.clear();
-    valid_candidates_index.resize(size, 0);
+    domains.Init(size, cache.GetValidPoints().size());
     solution.resize(size);
+    queued.Resize(size);
     force_stop = false;
+    nodes = 0;
   }
 
   void ResetSearch() {
     used_vertices.Clear();
-    std::fill(valid_candidates_index.begin(), valid_candidates_index.end(), 0);
+    domains.Reset();
     force_stop = false;
+    nodes = 0;
+    path.clear();
+  }
+
+  void SetArcConsistency(bool enable) { arc_consistency = enable; }
+
+  // Search() gives up after this many placed points, 0 for no limit.
+  void SetNodesLimit(size_t limit) { max_nodes = limit; }
+
+  // Kept by ResetSearch().
+  void SetHint(const std::vector<I2Point>& _hint) { hint = _hint; }
+
+  size_t Nodes() const { return nodes; }
+  bool Aborted() const { return max_nodes && (nodes >= max_nodes); }
+
+  void SetParallel(const std::atomic<bool>* _cancel,
+                   const std::atomic<unsigned>* _idle_workers, TSplit _split) {
+    cancel = _cancel;
+    idle_workers = _idle_workers;
+    split = _split;
   }
 
+  // Applies the decisions of a subtree after ResetSearch().
+  void Replay(const TPath& steps) {
+    for (auto& step : steps) {
+      AddPoint(step.vertex, step.p);
+      path.push_back(step);
+    }
+  }
+
+  // Searches the subtree set by Replay().
+  bool Resume() { return !force_stop && SearchI(); }
+
   void AddPoint(unsigned index, const I2Point& p) {
     // {
     //   for (unsigned i = 0; i < used_vertices.Size(); ++i) std::cout << "\t";
-    //   std::cout << index << "\t" << valid_candidates_index[index] << "\t" << p << std::endl;
+    //   std::cout << index << "\t" << domains.Size(index) << "\t" << p << std::endl;
     // }
     assert(!used_vertices.HasKey(index));
+    ++nodes;
     used_vertices.Insert(index);
     solution[index] = p;
+    domains.Mark();
+    queue.clear();
+    auto& points = cache.GetValidPoints();
+    unsigned k = 0;
     for (auto e : task.g.EdgesEI(index)) {
-      unsigned u = e.to;
+      unsigned u = e.to, ek = k++;
       if (used_vertices.HasKey(u)) {
         // Verify only
         auto p1 = solution[u];
@@ -80,55 +145,164 @@ class FullSearch {
           assert(false);    
         }
       } else {
-        // Filter points
-        auto& vcurrent = valid_candidates[u][valid_candidates_index[u]];
-        auto& vnext = valid_candidates[u][++valid_candidates_index[u]];
-        vnext.clear();
-        for (auto p1 : vcurrent) {
-          auto d = SquaredDistanceL2(p, p1);
-          if ((d >= e.info.first) && (d <= e.info.second) && cache.CheckSegmentI(I2ClosedSegment(p, p1))) {
-            vnext.push_back(p1);
-          }
+        // Filter points, by the annulus around p when it is smaller
+        if (cache.GetAnnuli().Size(cache.EdgeAnnulus(index, ek)) < domains.Size(u)) {
+          cache.ForEachInAnnulus(p, index, ek, [&](unsigned i) {
+            if (domains.HasKey(u, i) && cache.CheckSegmentI(I2ClosedSegment(p, points[i]))) domains.Keep(i);
+          });
+          domains.RestrictToKept(u);
+        } else {
+          domains.Filter(u, [&](unsigned i) {
+            auto d = SquaredDistanceL2(p, points[i]);
+            return (d >= e.info.first) && (d <= e.info.second) && cache.CheckSegmentI(I2ClosedSegment(p, points[i]));
+          });
         }
-        if (vnext.empty()) force_stop = true;
+        if (domains.Size(u) == 0) force_stop = true;
+        queue.push_back(u);
       }
     }
+    if (arc_consistency && !force_stop) Propagate(queue);
   }
   
   void RemoveLastPoint() {
-    unsigned index = used_vertices.Last();
-    for (auto e : task.g.EdgesEI(index)) {
-      unsigned u = e.to;
-      if (!used_vertices.HasKey(u)) {
-        --valid_candidates_index[u];
-      }
-    }
+    domains.Undo();
     used_vertices.RemoveLast();
     force_stop = false;
   }
 
 protected:
+  bool Cancelled() const { return Aborted() || (cancel && *cancel); }
+
+  // Hands the decisions steps[from..] of the current node over to other
+  // workers if some of them are idle; returns true if it did.
+  bool Split(const std::vector<Step>& steps, size_t from) {
+    if (!idle_workers || (*idle_workers == 0) || (from >= steps.size())) return false;
+    for (size_t j = from; j < steps.size(); ++j) {
+      TPath subtree = path;
+      subtree.push_back(steps[j]);
+      split(std::move(subtree));
+    }
+    return true;
+  }
+
+  // AC-3 over figure edges between unplaced vertices, starting from the
+  // vertices with changed domains. Sets force_stop if a domain gets empty.
+  void Propagate(const std::vector<unsigned>& changed) {
+    std::vector<unsigned> stack;
+    for (unsigned u : changed) {
+      if (!queued.HasKey(u)) {
+        queued.Insert(u);
+        stack.push_back(u);
+      }
+    }
+    auto& points = cache.GetValidPoints();
+    for (; !stack.empty() && !force_stop;) {
+      unsigned u = stack.back();
+      stack.pop_back();
+      queued.Remove(u);
+      if (domains.Size(u) > max_support_size) continue;
+      support.clear();
+      domains.ForEach(u, [&](unsigned i) { support.push_back(points[i]); });
+      auto box = Box(support);
+      unsigned k = 0;
+      for (auto e : task.g.EdgesEI(u)) {
+        unsigned w = e.to, ek = k++;
+        if (used_vertices.HasKey(w)) continue;
+        unsigned old_size = domains.Size(w);
+        if (cache.GetAnnuli().Size(cache.EdgeAnnulus(u, ek)) < old_size) {
+          // Collect the supported values from the annuli around supporters.
+          for (auto& p : support) {
+            cache.ForEachInAnnulus(p, u, ek, [&](unsigned i) {
+              if (domains.HasKey(w, i) && !domains.Kept(i) && cache.CheckSegmentI(I2ClosedSegment(p, points[i])))
+                domains.Keep(i);
+            });
+          }
+          domains.RestrictToKept(w);
+        } else {
+          int64_t r = USqrt(e.info.second) + 1;
+          domains.Filter(w, [&](unsigned i) {
+            auto& q = points[i];
+            if ((q.x < box.p1.x - r) || (q.x > box.p2.x + r) || (q.y < box.p1.y - r) || (q.y > box.p2.y + r))
+              return false;
+            for (auto& p : support) {
+              auto d = SquaredDistanceL2(p, q);
+              if ((d >= e.info.first) && (d <= e.info.second) && cache.CheckSegmentI(I2ClosedSegment(p, q)))
+                return true;
+            }
+            return false;
+          });
+        }
+        if (domains.Size(w) == 0) {
+          force_stop = true;
+          break;
+        }
+        if ((domains.Size(w) < old_size) && !queued.HasKey(w)) {
+          queued.Insert(w);
+          stack.push_back(w);
+        }
+      }
+    }
+    queued.Clear();
+  }
+
   bool SearchI() {
     if (used_vertices.Size() == task.g.Size()) {
       return true;
     }
+    if (Cancelled()) return false;
     unsigned min_size = cache.GetValidPoints().size() + 1;
     unsigned min_index = used_vertices.SetSize();
     for (unsigned i = 0; i < used_vertices.SetSize(); ++i) {
       if (used_vertices.HasKey(i)) continue;
-      if (valid_candidates[i][valid_candidates_index[i]].size() < min_size) {
-        min_size = valid_candidates[i][valid_candidates_index[i]].size();
+      if (domains.Size(i) < min_size) {
+        min_size = domains.Size(i);
         min_index = i;
       }
     }
     // std::cout << "\t" << min_index << "\t" << min_size << std::endl;
     assert(min_index < used_vertices.SetSize());
     if (min_size == 0) return false;
-    auto& v = valid_candidates[min_index][valid_candidates_index[min_index]];
-    for (auto& p : v) {
-      AddPoint(min_index, p);
+    // Candidates in index order from a random start, wrapping around, the
+    // hint first. The domain of min_index is the same again after every
+    // RemoveLastPoint(), so it is walked in place.
+    auto& points = cache.GetValidPoints();
+    const unsigned none = domains.Bits();
+    const unsigned start = std::uniform_int_distribution<unsigned>(0, none - 1)(re);
+    unsigned first = none;
+    if (!hint.empty()) {
+      int i = cache.GetValidPointsIndex().Get(hint[min_index].x, hint[min_index].y);
+      if ((i != LatticeIndex::invalid) && domains.HasKey(min_index, i)) first = unsigned(i);
+    }
+    // Candidate after i in that order, the first one for i == none.
+    auto rotated = [&](unsigned i) {
+      if (i < start) {
+        unsigned j = domains.Next(min_index, i + 1);
+        return (j < start) ? j : none;
+      }
+      unsigned j = domains.Next(min_index, (i == none) ? start : i + 1);
+      if (j < none) return j;
+      j = domains.Next(min_index, 0);
+      return (j < start) ? j : none;
+    };
+    auto after = [&](unsigned i) {
+      unsigned j = rotated((i == first) ? none : i);
+      return ((j == first) && (j < none)) ? rotated(j) : j;
+    };
+    for (unsigned i = (first < none) ? first : rotated(none); i < none; i = after(i)) {
+      if (Cancelled()) return false;
+      Step step{min_index, points[i], -1};
+      bool last = false;
+      if (idle_workers && (*idle_workers > 0)) {
+        std::vector<Step> rest;
+        for (unsigned j = after(i); j < none; j = after(j)) rest.push_back({min_index, points[j], -1});
+        last = Split(rest, 0);
+      }
+      AddPoint(min_index, step.p);
+      path.push_back(step);
       if (SearchI()) return true;
+      path.pop_back();
       RemoveLastPoint();
+      if (last) break;
     }
     return false;
   }
@@ -137,5 +311,6 @@ protected:
   bool Search() { return SearchI(); }
 
   const std::vector<I2Point>& GetSolution() const { return solution; }
+  const TaskCache& GetCache() const { return cache; }
 };
 }  // namespace solver
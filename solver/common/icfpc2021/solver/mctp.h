@@ -1,16 +1,26 @@
 #pragma once
 
+#include "common/data_structures/bitset_domains.h"
 #include "common/data_structures/unsigned_set.h"
 #include "common/geometry/d2/point.h"
+#include "common/geometry/d2/utils/box.h"
+#include "common/heap/ukvm/dheap.h"
 #include "common/icfpc2021/solution.h"
 #include "common/icfpc2021/task.h"
 #include "common/icfpc2021/task_cache.h"
 #include "common/icfpc2021/stat.h"
+#include "common/icfpc2021/stat_table.h"
 #include "common/timer.h"
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace solver {
@@ -21,15 +31,33 @@ class MCTP {
   std::string filename;
   TaskCache cache;
   ds::UnsignedSet used_vertices;
-  std::vector<std::vector<std::vector<I2Point>>> valid_candidates;
-  std::vector<unsigned> valid_candidates_index;
+  // Candidates of every vertex as indices of cache.GetValidPoints().
+  ds::BitsetDomains domains;
   std::vector<I2Point> solution;
   bool force_stop;
-  std::vector<std::vector<Stat>> points_stats;
-  std::vector<Stat> location_stats;
-  unsigned nruns;
-  double best_score;
-  Solution best_solution;
+  // First step of a run: for every valid point the best vertex to place
+  // there and the score of the pair, in a max-heap. Points touched by
+  // UpdateStat() are rescored at once; the others keep the logn and
+  // best_score of the last RefreshFirstStep(), which runs again when
+  // either has grown noticeably.
+  using THeap = heap::ukvm::DHeap<4, double, std::greater<double>>;
+
+  // Statistics and incumbent shared by all threads of a search. Location
+  // stat of valid point i is stats block i, entry 0, followed by the stat of
+  // every vertex at i. The heap is guarded by first_step_mutex, the best
+  // solution and its file by best_mutex.
+  struct Shared {
+    StatTable stats;
+    std::mutex first_step_mutex;
+    std::unique_ptr<THeap> first_step;
+    std::vector<unsigned> first_step_vertex;
+    double first_step_logn, first_step_best;
+    std::atomic<unsigned> nruns{0};
+    std::atomic<double> best_score{1e-10};
+    std::mutex best_mutex;
+    Solution best_solution;
+  };
+  std::shared_ptr<Shared> shared;
   unsigned max_time_for_search; // in seconds
 
  public:
@@ -38,12 +66,10 @@ class MCTP {
     task_id = _task_id;
     filename = "solutions/mctp/" + std::to_string(task_id) + ".json";
     cache.Init(task);
-    nruns = 0;
-    if (best_solution.Load(filename)) {
-      std::cout << "Found solution with score: " << task.Score(best_solution) << std::endl;
-      best_score = task.RawPoints(best_solution);
-    } else {
-      best_score = 1e-10;
+    shared = std::make_shared<Shared>();
+    if (shared->best_solution.Load(filename)) {
+      std::cout << "Found solution with score: " << task.Score(shared->best_solution) << std::endl;
+      shared->best_score = task.RawPoints(shared->best_solution);
     }
     InitSearch();
     max_time_for_search = max_time;
@@ -53,34 +79,91 @@ class MCTP {
   void InitSearch() {
     unsigned size = task.g.Size();
     used_vertices.Resize(size);
-    valid_candidates.clear();
-    valid_candidates.resize(size);
-    for (unsigned i = 0; i < size; ++i) {
-      valid_candidates[i].resize(2 * size + 1); // For safety
-      valid_candidates[i][0] = cache.GetValidPoints();
-    }
-    valid_candidates_index.clear();
-    valid_candidates_index.resize(size, 0);
+    domains.Init(size, cache.GetValidPoints().size());
     solution.resize(size);
     force_stop = false;
-    location_stats.clear();
-    location_stats.resize(cache.MaxIndex());
-    points_stats.clear();
-    points_stats.resize(task.g.Size(), location_stats);
+    shared->stats.Init(cache.GetValidPoints().size(), size + 1);
+    RefreshFirstStep(0., shared->best_score);
   }
 
   void ResetSearch() {
     used_vertices.Clear();
-    std::fill(valid_candidates_index.begin(), valid_candidates_index.end(), 0);
+    domains.Reset();
     force_stop = false;
   }
 
-  void UpdateStat(double score) {
+  // Location stat plus the best vertex stat of valid point i; the vertex
+  // is returned in u.
+  double FirstStepScore(unsigned i, double logn, double best_score,
+                        unsigned& u) const {
+    const auto* ps = shared->stats.Find(i);
+    u = 0;
+    if (!ps) return 2 * Stat().Score(logn, best_score);
+    double best = StatTable::Get(ps, 1).Score(logn, best_score);
+    for (unsigned v = 1; v + 1 < shared->stats.Width(); ++v) {
+      double d = StatTable::Get(ps, v + 1).Score(logn, best_score);
+      if (best < d) {
+        best = d;
+        u = v;
+      }
+    }
+    return StatTable::Get(ps, 0).Score(logn, best_score) + best;
+  }
+
+  // Requires first_step_mutex once the search has started.
+  void RefreshFirstStep(double logn, double best_score) {
+    auto& s = *shared;
+    unsigned npoints = cache.GetValidPoints().size();
+    std::vector<double> scores(npoints);
+    s.first_step_vertex.resize(npoints);
+    for (unsigned i = 0; i < npoints; ++i)
+      scores[i] = FirstStepScore(i, logn, best_score, s.first_step_vertex[i]);
+    s.first_step.reset(new THeap(scores, false));
+    s.first_step_logn = logn;
+    s.first_step_best = best_score;
+  }
+
+  // Best first step as (point, vertex), with a virtual loss for it, or false
+  // if there are no valid points.
+  bool ChooseFirstStep(double logn, double best_score, unsigned& i,
+                       unsigned& u) {
+    auto& s = *shared;
+    std::lock_guard<std::mutex> lock(s.first_step_mutex);
+    if ((logn > 1.05 * s.first_step_logn + 0.05) ||
+        (best_score > s.first_step_best))
+      RefreshFirstStep(logn, best_score);
+    if (s.first_step->Empty()) return false;
+    i = s.first_step->TopKey();
+    u = s.first_step_vertex[i];
+    AddVisit(i, u);
+    s.first_step->Set(
+        i, FirstStepScore(i, logn, best_score, s.first_step_vertex[i]));
+    return true;
+  }
+
+  void AddVisit(unsigned i, unsigned u) {
+    auto* ps = shared->stats.FindOrAdd(i);
+    StatTable::AddVisit(ps, 0);
+    StatTable::AddVisit(ps, u + 1);
+  }
+
+  // Adds the score of the run to the stats visited by it.
+  void UpdateStat(double score, double logn, double best_score) {
+    auto& s = *shared;
+    auto& index = cache.GetValidPointsIndex();
     for (unsigned u = 0; u < task.g.Size(); ++u) {
       if (used_vertices.HasKey(u)) {
-        auto index = cache.Index(solution[u]);
-        location_stats[index].Add(score);
-        points_stats[u][index].Add(score);
+        auto* ps = s.stats.FindOrAdd(index.Get(solution[u].x, solution[u].y));
+        StatTable::AddValue(ps, 0, score);
+        StatTable::AddValue(ps, u + 1, score);
+      }
+    }
+    std::lock_guard<std::mutex> lock(s.first_step_mutex);
+    for (unsigned u = 0; u < task.g.Size(); ++u) {
+      if (used_vertices.HasKey(u)) {
+        unsigned i = index.Get(solution[u].x, solution[u].y);
+        s.first_step->Set(
+            i, FirstStepScore(i, logn, best_score, s.first_step_vertex[i]));
       }
     }
   }
@@ -89,8 +172,11 @@ class MCTP {
     assert(!used_vertices.HasKey(index));
     used_vertices.Insert(index);
     solution[index] = p;
+    domains.Mark();
+    auto& points = cache.GetValidPoints();
+    unsigned k = 0;
     for (auto e : task.g.EdgesEI(index)) {
-      unsigned u = e.to;
+      unsigned u = e.to, ek = k++;
       if (used_vertices.HasKey(u)) {
         // Verify only
         auto p1 = solution[u];
@@ -100,98 +186,144 @@ class MCTP {
           assert(false);    
         }
       } else {
-        // Filter points
-        auto& vcurrent = valid_candidates[u][valid_candidates_index[u]];
-        auto& vnext = valid_candidates[u][++valid_candidates_index[u]];
-        vnext.clear();
-        for (auto p1 : vcurrent) {
-          auto d = SquaredDistanceL2(p, p1);
-          if ((d >= e.info.first) && (d <= e.info.second) && cache.CheckSegmentI(I2ClosedSegment(p, p1))) {
-            vnext.push_back(p1);
-          }
+        // Filter points, by the annulus around p when it is smaller
+        if (cache.GetAnnuli().Size(cache.EdgeAnnulus(index, ek)) < domains.Size(u)) {
+          cache.ForEachInAnnulus(p, index, ek, [&](unsigned i) {
+            if (domains.HasKey(u, i) && cache.CheckSegmentI(I2ClosedSegment(p, points[i]))) domains.Keep(i);
+          });
+          domains.RestrictToKept(u);
+        } else {
+          domains.Filter(u, [&](unsigned i) {
+            auto d = SquaredDistanceL2(p, points[i]);
+            return (d >= e.info.first) && (d <= e.info.second) && cache.CheckSegmentI(I2ClosedSegment(p, points[i]));
+          });
         }
-        if (vnext.empty()) force_stop = true;
+        if (domains.Size(u) == 0) force_stop = true;
       }
     }
   }
 
   void RemoveLastPoint() {
-    unsigned index = used_vertices.Last();
-    for (auto e : task.g.EdgesEI(index)) {
-      unsigned u = e.to;
-      if (!used_vertices.HasKey(u)) {
-        --valid_candidates_index[u];
-      }
-    }
+    domains.Undo();
     used_vertices.RemoveLast();
     force_stop = false;
   }
 
   void Run() {
+    auto& s = *shared;
     ResetSearch();
-    double logn = log(double(++nruns));
+    double logn = log(double(++s.nruns));
+    const double best_score = s.best_score;
+    auto& points = cache.GetValidPoints();
     unsigned gsize = task.g.Size();
     for (; used_vertices.Size() < gsize;) {
-      unsigned best_u = gsize;
-      I2Point pnext;
-      double best_stat_score = 0.;
+      unsigned best_u = gsize, best_i = 0;
+      double best_stat_score = -1.;
       if (used_vertices.Size() == 0) {
-        for (auto p : cache.GetValidPoints()) {
-          auto index = cache.Index(p);
-          double d1 = location_stats[index].Score(logn, best_score);
-          for (unsigned u = 0; u < gsize; ++u) {
-            double d2 = points_stats[u][index].Score(logn, best_score);
-            if (best_stat_score < d1 + d2) {
-              best_stat_score = d1 + d2;
-              best_u = u;
-              pnext = p;
-            }
-          }
-        }
+        if (!ChooseFirstStep(logn, best_score, best_i, best_u)) break;
       } else {
-        unsigned min_size = cache.MaxIndex() + 1;
+        unsigned min_size = points.size() + 1;
         for (unsigned u = 0; u < gsize; ++u) {
           if (used_vertices.HasKey(u)) continue;
-          if (valid_candidates[u][valid_candidates_index[u]].size() < min_size) {
-            min_size = valid_candidates[u][valid_candidates_index[u]].size();
+          if (domains.Size(u) < min_size) {
+            min_size = domains.Size(u);
             best_u = u;
           }
         }
         if (min_size == 0) break;
-        for (auto p : valid_candidates[best_u][valid_candidates_index[best_u]]) {
-          auto index = cache.Index(p);
-          double d = points_stats[best_u][index].Score(logn, best_score);
+        const double empty_score = Stat().Score(logn, best_score);
+        domains.ForEach(best_u, [&](unsigned i) {
+          const auto* ps = s.stats.Find(i);
+          double d = ps ? StatTable::Get(ps, best_u + 1).Score(logn, best_score) : empty_score;
           if (best_stat_score < d) {
               best_stat_score = d;
-              pnext = p;
+              best_i = i;
           }
-        }
+        });
+        AddVisit(best_i, best_u);
       }
-      AddPoint(best_u, pnext);
+      AddPoint(best_u, points[best_i]);
       if (force_stop) break;
     }
     double dscore = 0.;
     if (used_vertices.Size() == gsize) {
-      Solution s{solution};
-      dscore = task.RawPoints(s);
-      if (dscore > best_score) {
-        std::cout << "New best solution: " << task.Score(s) << "\t" << nruns << std::endl;
-        best_score = dscore;
-        best_solution = s;
-        auto js = best_solution.ToJson();
-        std::ofstream of(filename);
-        of << js;
+      Solution sol{solution};
+      // Every edge was checked by AddPoint().
+      dscore = task.TrustedRawPoints(sol);
+      if (dscore > s.best_score) {
+        std::lock_guard<std::mutex> lock(s.best_mutex);
+        if (dscore > s.best_score) {
+          std::cout << "New best solution for " << task_id << ": " << task.Score(sol) << "\t" << s.nruns << std::endl;
+          s.best_solution = sol;
+          auto js = s.best_solution.ToJson();
+          std::ofstream of(filename);
+          of << js;
+          s.best_score = dscore;
+        }
       }
     }
-    UpdateStat(dscore);
+    UpdateStat(dscore, logn, s.best_score);
+  }
+
+  // Runs on the given number of threads while condition() holds. The extra
+  // threads work on copies of this search that share its statistics.
+  template <class TCondition>
+  void RunWhile(unsigned threads, TCondition condition) {
+    std::vector<MCTP> workers(std::max(threads, 1u) - 1, *this);
+    std::vector<std::thread> pool;
+    for (auto& w : workers)
+      pool.emplace_back([&w, &condition]() {
+        for (; condition();) w.Run();
+      });
+    for (; condition();) Run();
+    for (auto& t : pool) t.join();
   }
 
  public:
-  void Search() {
+  void Search(unsigned threads = 1) {
     Timer t;
-    for (;(best_score < 1) && (t.GetSeconds() < max_time_for_search);) {
-      Run();
-    }
+    RunWhile(threads, [&]() {
+      return (shared->best_score < 1) &&
+             (t.GetSeconds() < max_time_for_search);
+    });
+  }
+
+  // Continues the search for about the given time, keeping all statistics.
+  void SearchFor(size_t milliseconds, unsigned threads = 1) {
+    Timer t;
+    RunWhile(threads, [&]() {
+      return (shared->best_score < 1) && (t.GetMilliseconds() < milliseconds);
+    });
+  }
+
+  unsigned Runs() const { return shared->nruns; }
+
+  // Bytes held by the search statistics, candidate domains, segment cache
+  // and lattice. Grows as runs visit new points.
+  size_t MemoryUsage() const {
+    return cache.MemoryUsage() + shared->stats.MemoryUsage() +
+           shared->first_step_vertex.capacity() *
+               (sizeof(unsigned) + sizeof(THeap::TPositionValue) +
+                sizeof(THeap::TPointer)) +
+           domains.MemoryUsage();
+  }
+
+  // MemoryUsage() of a new search, with statistics for a few thousand
+  // points; computed from the hole box, so the lattice is not built. Every
+  // cell of the box counts as a valid point.
+  static size_t EstimateMemoryUsage(const Task& task) {
+    auto box = Box(task.hole.v);
+    size_t points = size_t(box.p2.x - box.p1.x + 1) * size_t(box.p2.y - box.p1.y + 1);
+    return (task.g.Size() + 1) * std::min<size_t>(points, 4096) * sizeof(StatTable::Entry) +
+           points * 6 * sizeof(unsigned) + task.g.Size() * points / 8 +
+           SegmentCache::EstimateMemoryUsage(unsigned(points)) +
+           points * (sizeof(I2Point) + 2 * sizeof(int64_t) + 3 * sizeof(int));
+  }
+
+  // RawPoints of the best solution so far, 0 if there is none.
+  double BestRawPoints() const {
+    double best_score = shared->best_score;
+    return (best_score < 1e-9) ? 0. : best_score;
   }
 };
 }  // namespace solver
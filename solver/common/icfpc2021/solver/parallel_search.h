@@ -0,0 +1,136 @@
+#pragma once
+
+#include "common/geometry/d2/point.h"
+#include "common/icfpc2021/solver/full_search.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace solver {
+// Runs FullSearch or PerfectScore (TSearch) on several threads. Every worker
+// owns a copy of the search with its own domains and a deque of open
+// subtrees, given by the decisions from the root. A worker replays a subtree
+// and searches it; while some workers are idle, searches hand the remaining
+// siblings of their current node over to their own deque. Idle workers take
+// the oldest (largest) subtrees of other deques. The first solution found
+// stops everyone.
+template <class TSearch>
+class ParallelSearch {
+ public:
+  using TPath = FullSearch::TPath;
+
+ protected:
+  struct Worker {
+    TSearch search;
+    std::mutex mutex;
+    std::deque<TPath> subtrees;
+
+    explicit Worker(const TSearch& prototype) : search(prototype) {}
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::atomic<bool> cancel;
+  std::atomic<unsigned> idle;
+  std::atomic<size_t> pending;  // Subtrees not searched yet
+  std::atomic<size_t> nodes;
+  std::mutex solution_mutex;
+  bool found;
+  std::vector<I2Point> solution;
+
+ public:
+  // The prototype is copied as is, including its ResetSearch() settings.
+  ParallelSearch(const TSearch& prototype, unsigned threads) {
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i)
+      workers.emplace_back(new Worker(prototype));
+  }
+
+  bool Search() {
+    cancel = false;
+    idle = 0;
+    nodes = 0;
+    found = false;
+    pending = 1;
+    workers[0]->subtrees.push_back({});
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < workers.size(); ++i)
+      threads.emplace_back(&ParallelSearch::Work, this, i);
+    for (auto& t : threads) t.join();
+    return found;
+  }
+
+  const std::vector<I2Point>& GetSolution() const { return solution; }
+
+  // Placed points over all workers, without replays.
+  size_t Nodes() const { return nodes; }
+
+ protected:
+  void Push(unsigned i, TPath&& path) {
+    ++pending;
+    std::lock_guard<std::mutex> lock(workers[i]->mutex);
+    workers[i]->subtrees.push_back(std::move(path));
+  }
+
+  // Deepest subtree of own deque or oldest subtree of another one.
+  bool Pop(unsigned i, TPath& path) {
+    for (unsigned k = 0; k < workers.size(); ++k) {
+      auto& w = *workers[(i + k) % workers.size()];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      if (w.subtrees.empty()) continue;
+      if (k == 0) {
+        path = std::move(w.subtrees.back());
+        w.subtrees.pop_back();
+      } else {
+        path = std::move(w.subtrees.front());
+        w.subtrees.pop_front();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void Work(unsigned i) {
+    auto& search = workers[i]->search;
+    search.SetParallel(&cancel, &idle,
+                       [this, i](TPath&& path) { Push(i, std::move(path)); });
+    bool is_idle = false;
+    for (TPath path;;) {
+      if (Pop(i, path)) {
+        if (is_idle) {
+          --idle;
+          is_idle = false;
+        }
+        if (!cancel) {
+          search.ResetSearch();
+          search.Replay(path);
+          size_t replayed = search.Nodes();
+          if (search.Resume()) {
+            std::lock_guard<std::mutex> lock(solution_mutex);
+            if (!found) {
+              found = true;
+              solution = search.GetSolution();
+            }
+            cancel = true;
+          }
+          nodes += search.Nodes() - replayed;
+        }
+        --pending;
+      } else if (pending == 0) {
+        break;
+      } else {
+        if (!is_idle) {
+          ++idle;
+          is_idle = true;
+        }
+        std::this_thread::yield();
+      }
+    }
+    if (is_idle) --idle;
+    search.SetParallel(nullptr, nullptr, nullptr);
+  }
+};
+}  // namespace solver
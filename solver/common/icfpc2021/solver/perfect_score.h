@@ -4,7 +4,10 @@
 #include "common/data_structures/unsigned_set.h"
 #include "common/geometry/d2/point.h"
 #include "common/icfpc2021/solver/full_search.h"
+#include "common/numeric/utils/usqrt.h"
 
+#include <algorithm>
+#include <utility>
 #include <vector>
 
 namespace solver {
@@ -15,6 +18,9 @@ class PerfectScore : public FullSearch {
  protected:
   std::vector<I2Point> vertexes_to_cover;
   ds::UnsignedSet covered_vertexes;
+  std::vector<std::pair<int64_t, unsigned>> disc_vertices;
+  // First cover steps whose subtrees were searched without a solution.
+  TPath failed_first_steps;
 
  public:
   PerfectScore(const Task& _task) : FullSearch(_task) {
@@ -24,6 +30,7 @@ class PerfectScore : public FullSearch {
   void ResetSearch() {
     TBase::ResetSearch();
     covered_vertexes.Clear();
+    failed_first_steps.clear();
   }
 
   void ResetSearch(const std::vector<I2Point>& _vertexes_to_cover) {
@@ -32,43 +39,69 @@ class PerfectScore : public FullSearch {
     ResetSearch();
   }
 
+  // Besides the edges of index, restricts every unplaced vertex to the disc
+  // of its graph distance from index. Small domains are filtered directly;
+  // larger ones are intersected with the column ranges of the disc, built
+  // once per distinct distance, so the cost does not depend on their size.
   void AddPoint(unsigned index, const I2Point& p) {
-    assert(!used_vertices.HasKey(index));
+    TBase::AddPoint(index, p);
+    auto& points = cache.GetValidPoints();
+    queue.clear();
+    disc_vertices.clear();
     for (unsigned u = 0; u < used_vertices.SetSize(); ++u) {
-      if (u == index) continue; 
-      if (!used_vertices.HasKey(u)) {
-        // Filter points
-        auto& vcurrent = valid_candidates[u][valid_candidates_index[u]];
-        auto& vnext = valid_candidates[u][++valid_candidates_index[u]];
-        vnext.clear();
-        for (auto p1 : vcurrent) {
-          auto d = SquaredDistanceL2(p, p1);
-          // auto d = cache.SegmentHoleDistance({p, p1});
-          if (d <= cache.max_distance[index][u]) {
-        //   if ((d >= cache.min_distance[index][u]) && (d <= cache.max_distance[index][u])) {
-            vnext.push_back(p1);
-          }
-        }
-        if (vnext.empty()) force_stop = true;
+      if (used_vertices.HasKey(u)) continue;
+      auto max_distance = cache.MaxDistance(index, u);
+      if (cache.DiscCoversAll(p, max_distance)) continue;
+      if (domains.Size(u) > 2 * USqrt(max_distance) + 1) {
+        disc_vertices.push_back({max_distance, u});
+        continue;
       }
+      unsigned old_size = domains.Size(u);
+      domains.Filter(u, [&](unsigned i) {
+        return SquaredDistanceL2(p, points[i]) <= max_distance;
+      });
+      Restricted(u, old_size);
     }
-    TBase::AddPoint(index, p);
-  }
-  
-  void RemoveLastPoint() {
-    unsigned index = used_vertices.Last();
-    TBase::RemoveLastPoint();
-    for (unsigned u = 0; u < used_vertices.SetSize(); ++u) {
-      if (u == index) continue;
-      if (!used_vertices.HasKey(u)) {
-        --valid_candidates_index[u];
+    std::sort(disc_vertices.begin(), disc_vertices.end());
+    for (size_t k = 0; k < disc_vertices.size();) {
+      auto max_distance = disc_vertices[k].first;
+      size_t l = k;
+      unsigned first = domains.Bits(), last = 0;
+      for (; (l < disc_vertices.size()) &&
+             (disc_vertices[l].first == max_distance);
+           ++l) {
+        auto range = domains.BitRange(disc_vertices[l].second);
+        first = std::min(first, range.first);
+        last = std::max(last, range.second);
+      }
+      cache.ForEachInDisc(p, max_distance, first, last,
+                          [&](unsigned b, unsigned e) {
+                            domains.KeepRange(b, e);
+                          });
+      for (; k < l; ++k) {
+        unsigned u = disc_vertices[k].second, old_size = domains.Size(u);
+        domains.RestrictToKept(u, false);
+        Restricted(u, old_size);
       }
+      domains.ClearKept();
     }
+    if (arc_consistency && !force_stop) Propagate(queue);
   }
 
  protected:
+  // Index of p in cache.GetValidPoints(), -1 if p is not a valid point.
+  int PointIndex(const I2Point& p) const {
+    return cache.GetValidPointsIndex().Get(p.x, p.y);
+  }
+
+  void Restricted(unsigned u, unsigned old_size) {
+    if (domains.Size(u) == 0) force_stop = true;
+    if (domains.Size(u) < old_size) queue.push_back(u);
+  }
+
   bool SearchI(unsigned k) {
     if (k == vertexes_to_cover.size()) return TBase::Search();
+    if (Cancelled()) return false;
     unsigned bestk = vertexes_to_cover.size(), bestkvalue = used_vertices.SetSize() + 1;
     if (k == 0) {
       int64_t max_distance = 0;
@@ -87,20 +120,12 @@ class PerfectScore : public FullSearch {
     {
       for (unsigned ik = 0; ik < vertexes_to_cover.size(); ++ik) {
         if (covered_vertexes.HasKey(ik)) continue;
-        auto p = vertexes_to_cover[ik];
+        int pi = PointIndex(vertexes_to_cover[ik]);
         unsigned count = 0;
         for (unsigned i = 0; i < used_vertices.SetSize(); ++i) {
           if (used_vertices.HasKey(i)) continue;
-          auto& v = valid_candidates[i][valid_candidates_index[i]];
-          if (v.size() == 0) return false;
-          bool is_valid = false;
-          for (auto& vp : v) {
-            if (vp == p) {
-              is_valid = true;
-              break;
-            }
-          }
-          if (is_valid) ++count;
+          if (domains.Size(i) == 0) return false;
+          if ((pi >= 0) && domains.HasKey(i, pi)) ++count;
         }
         if (count < bestkvalue) {
           bestkvalue = count;
@@ -112,24 +137,28 @@ class PerfectScore : public FullSearch {
     if (bestkvalue == 0) return false;
 
     auto p = vertexes_to_cover[bestk];
-    covered_vertexes.Insert(bestk);
+    int pi = PointIndex(p);
+    std::vector<Step> v;
     for (unsigned i = 0; i < used_vertices.SetSize(); ++i) {
       if (used_vertices.HasKey(i)) continue;
-      auto& v = valid_candidates[i][valid_candidates_index[i]];
-      bool is_valid = false;
-      for (auto& vp : v) {
-        if (vp == p) {
-          is_valid = true;
-          break;
-        }
-      }
-      if (is_valid) {
-        AddPoint(i, p);
-        if (!force_stop) {
-          if (SearchI(k + 1)) return true;
-        }
-        RemoveLastPoint();
+      if ((pi >= 0) && domains.HasKey(i, pi)) v.push_back({i, p, int(bestk)});
+    }
+    if (!hint.empty()) {
+      std::stable_partition(v.begin(), v.end(), [&](const Step& step) { return hint[step.vertex] == p; });
+    }
+    covered_vertexes.Insert(bestk);
+    for (size_t j = 0; j < v.size(); ++j) {
+      if (Cancelled()) break;
+      if (Split(v, j + 1)) v.resize(j + 1);
+      AddPoint(v[j].vertex, p);
+      path.push_back(v[j]);
+      if (!force_stop) {
+        if (SearchI(k + 1)) return true;
       }
+      path.pop_back();
+      RemoveLastPoint();
+      // Parts of the subtree may have been split off to other workers.
+      if ((k == 0) && !split && !Cancelled()) failed_first_steps.push_back(v[j]);
     }
     covered_vertexes.RemoveLast();
     return false;
@@ -138,7 +167,43 @@ class PerfectScore : public FullSearch {
  public:
   bool Search() {
     if (used_vertices.SetSize() < vertexes_to_cover.size()) return false;
-    return SearchI(0);
+    return !force_stop && SearchI(0);
+  }
+
+  // Cover steps that lead to no solution of this task; every task with more
+  // vertexes to cover has no solution with them either.
+  const TPath& FailedFirstSteps() const { return failed_first_steps; }
+
+  // Removes the points of steps from the domains of their vertices, after
+  // ResetSearch().
+  void Exclude(const TPath& steps) {
+    for (auto& step : steps) {
+      int pi = PointIndex(step.p);
+      if (pi < 0) continue;
+      domains.AndWord(step.vertex, unsigned(pi) / ds::BitsetDomains::bits_per_word,
+                      ~(ds::BitsetDomains::TWord(1) << (unsigned(pi) % ds::BitsetDomains::bits_per_word)));
+      if (domains.Size(step.vertex) == 0) force_stop = true;
+    }
+  }
+
+  // Applies the decisions of a subtree after ResetSearch(). Steps without
+  // a covered hole vertex come from the final FullSearch phase.
+  void Replay(const TPath& steps) {
+    for (auto& step : steps) {
+      if (step.cover >= 0) {
+        covered_vertexes.Insert(step.cover);
+        AddPoint(step.vertex, step.p);
+      } else {
+        TBase::AddPoint(step.vertex, step.p);
+      }
+      path.push_back(step);
+    }
+  }
+
+  // Searches the subtree set by Replay().
+  bool Resume() {
+    if (used_vertices.SetSize() < vertexes_to_cover.size()) return false;
+    return !force_stop && SearchI(covered_vertexes.Size());
   }
 };
 }  // namespace solver
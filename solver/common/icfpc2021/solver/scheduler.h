@@ -0,0 +1,203 @@
+#pragma once
+
+#include "common/icfpc2021/solver/mctp.h"
+#include "common/icfpc2021/task.h"
+#include "common/timer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace solver {
+// Runs MCTP on a range of problems at once on a shared pool of threads.
+// Every worker takes the idle problem with the largest expected gain and
+// searches it for one time slice. The gain is the gap in contest points
+// between our score and the best known one (as in submitter/gap.py), divided
+// by the number of slices the problem already got. A problem is retired once
+// it reaches 0 dislikes or the best known score, or after max_time seconds.
+//
+// Search statistics of idle problems stay in memory between slices as long
+// as they fit into max_memory; otherwise the least promising idle ones are
+// dropped and start over (from their saved best solution) next time.
+class Scheduler {
+ protected:
+  struct Job {
+    unsigned task_id;
+    Task task;
+    double weight;      // 1000 * log2(E * H * V / 6)
+    double best_ratio;  // sqrt(1 + best known dislikes)
+    double raw_points;  // 1 / sqrt(1 + our dislikes), 0 without a solution
+    size_t slices = 0;
+    size_t milliseconds = 0;
+    size_t memory = 0;  // reserved for solver
+    bool running = false;
+    bool retired = false;
+    std::unique_ptr<MCTP> solver;
+  };
+
+  std::vector<Job> jobs;
+  unsigned max_time;  // in seconds, per problem
+  size_t slice;       // in milliseconds
+  size_t max_memory;  // in bytes, for all resident solvers
+  size_t memory = 0;
+  std::mutex mutex;
+  std::condition_variable released;
+
+ public:
+  // scores_filename is a csv with problem,score,best_score columns as
+  // written by submitter/downloadScores.py; problems missing there are
+  // treated as unsolved with 0 as the best known score.
+  Scheduler(unsigned first, unsigned last, unsigned _max_time,
+            const std::string& scores_filename, size_t _max_memory,
+            size_t _slice = 2000)
+      : max_time(_max_time), slice(_slice), max_memory(_max_memory) {
+    auto scores = LoadScores(scores_filename);
+    jobs.resize(last + 1 - first);
+    for (unsigned i = first; i <= last; ++i) {
+      auto& job = jobs[i - first];
+      job.task_id = i;
+      job.task.Load("problems/" + std::to_string(i) + ".json");
+      job.weight = 1000. * log2(double(job.task.g.EdgesSize()) *
+                                job.task.hole.Size() * job.task.g.Size() /
+                                6.);
+      auto it = scores.find(i);
+      if (it != scores.end()) {
+        job.best_ratio = sqrt(1. + it->second.second);
+        job.raw_points =
+            (it->second.first < 0) ? 0. : 1. / sqrt(1. + it->second.first);
+      } else {
+        job.best_ratio = 1.;
+        job.raw_points = 0.;
+      }
+      job.retired = Done(job);
+    }
+  }
+
+  void Run(unsigned threads) {
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i)
+      workers.emplace_back(&Scheduler::Work, this);
+    for (auto& w : workers) w.join();
+  }
+
+ protected:
+  // problem -> (our dislikes or -1, best known dislikes)
+  static std::unordered_map<unsigned, std::pair<int64_t, int64_t>> LoadScores(
+      const std::string& filename) {
+    std::unordered_map<unsigned, std::pair<int64_t, int64_t>> scores;
+    std::ifstream is(filename);
+    std::string line;
+    std::getline(is, line);  // Header
+    for (; std::getline(is, line);) {
+      std::stringstream ss(line);
+      std::string problem, score, best_score;
+      std::getline(ss, problem, ',');
+      std::getline(ss, score, ',');
+      std::getline(ss, best_score, ',');
+      if (problem.empty() || best_score.empty()) continue;
+      bool solved = !score.empty() && isdigit(score[0]);
+      scores[std::stoul(problem)] = {solved ? std::stoll(score) : -1,
+                                     std::stoll(best_score)};
+    }
+    return scores;
+  }
+
+  static bool Done(const Job& job) {
+    const double eps = 1e-9;
+    return (job.raw_points >= 1. - eps) ||
+           (job.raw_points * job.best_ratio >= 1. - eps);
+  }
+
+  static double Gap(const Job& job) {
+    return job.weight * (1. - std::min(1., job.raw_points * job.best_ratio));
+  }
+
+  static double Priority(const Job& job) {
+    return Gap(job) / (1. + job.slices);
+  }
+
+  void Release(Job& job) {
+    job.solver.reset();
+    memory -= job.memory;
+    job.memory = 0;
+  }
+
+  // Marks the idle problem with the largest expected gain that fits into
+  // memory as running and returns it; waits while all idle problems are too
+  // large. Returns nullptr if there are no idle problems. Retired problems
+  // never come back, so a worker that finds nothing to do will not be
+  // needed any more.
+  Job* Next(std::unique_lock<std::mutex>& lock) {
+    for (;;) {
+      std::vector<Job*> idle;
+      for (auto& job : jobs) {
+        if (!job.running && !job.retired) idle.push_back(&job);
+      }
+      if (idle.empty()) return nullptr;
+      std::sort(idle.begin(), idle.end(), [](const Job* a, const Job* b) {
+        return Priority(*a) > Priority(*b);
+      });
+      // Make room for the best one by dropping the least promising.
+      Job* best = idle[0];
+      size_t needed = best->solver ? 0 : MCTP::EstimateMemoryUsage(best->task);
+      for (auto it = idle.rbegin(); (*it != best) && (memory + needed > max_memory); ++it) {
+        if ((*it)->solver) Release(**it);
+      }
+      for (auto job : idle) {
+        size_t size = job->solver ? 0 : MCTP::EstimateMemoryUsage(job->task);
+        if ((memory == 0) || (memory + size <= max_memory)) {
+          job->running = true;
+          job->memory += size;
+          memory += size;
+          return job;
+        }
+      }
+      released.wait(lock);
+    }
+  }
+
+  void Work() {
+    for (;;) {
+      Job* job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        job = Next(lock);
+      }
+      if (!job) return;
+      Timer t;
+      if (!job->solver) {
+        job->solver.reset(new MCTP(job->task, job->task_id, max_time));
+        std::lock_guard<std::mutex> lock(mutex);
+        memory = memory - job->memory + job->solver->MemoryUsage();
+        job->memory = job->solver->MemoryUsage();
+      }
+      job->solver->SearchFor(slice);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      // Statistics grow with the points the slice visited.
+      memory = memory - job->memory + job->solver->MemoryUsage();
+      job->memory = job->solver->MemoryUsage();
+      ++job->slices;
+      job->milliseconds += t.GetMilliseconds();
+      job->raw_points = std::max(job->raw_points, job->solver->BestRawPoints());
+      job->running = false;
+      if (Done(*job) || (job->milliseconds >= 1000 * size_t(max_time))) {
+        job->retired = true;
+        Release(*job);
+        std::cout << "Retired problem " << job->task_id << "\tgap " << Gap(*job)
+                  << "\t" << job->milliseconds / 1000 << "s" << std::endl;
+      }
+      released.notify_all();
+    }
+  }
+};
+}  // namespace solver
@@ -14,7 +14,7 @@ class Stat {
       // s2 += x * x;
   }
 
-  double Score(double log_n_total, double max_score) {
+  double Score(double log_n_total, double max_score) const {
     static const double c = sqrt(2.0);
     if (n == 0) return (c + 1) * max_score;
     // return sqrt(s2 / n) + s / n + c * sqrt(log_n_total / n);
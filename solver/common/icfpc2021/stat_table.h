@@ -0,0 +1,95 @@
+#pragma once
+
+#include "common/base.h"
+#include "common/icfpc2021/stat.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Sparse table of Stat blocks: every key (a valid point) gets a block of
+// width stats when it is first used. Blocks are allocated in chunks and never
+// move, and every field is an atomic, so any number of threads can read and
+// update stats without locks; only allocating a block takes the mutex.
+//
+// Updates are split for virtual loss: AddVisit() counts a visit as soon as a
+// run chooses the stat, AddValue() adds its score when the run ends. Until
+// then the stat looks like a run that scored 0, which steers other threads
+// to different choices.
+class StatTable {
+ public:
+  struct Entry {
+    std::atomic<unsigned> n{0};
+    std::atomic<double> s{0.};
+  };
+
+  static const unsigned blocks_per_chunk = 256;
+
+ protected:
+  unsigned width = 0, nblocks = 0;
+  std::unique_ptr<std::atomic<Entry*>[]> block_of;
+  std::vector<std::unique_ptr<Entry[]>> chunks;
+  std::mutex mutex;
+
+ public:
+  // All stats are empty.
+  void Init(unsigned nkeys, unsigned _width) {
+    width = _width;
+    nblocks = 0;
+    block_of.reset(new std::atomic<Entry*>[nkeys]);
+    for (unsigned i = 0; i < nkeys; ++i) block_of[i] = nullptr;
+    chunks.clear();
+    chunks.resize((nkeys + blocks_per_chunk - 1) / blocks_per_chunk);
+  }
+
+  unsigned Width() const { return width; }
+
+  // Block of the key, nullptr if it has none yet.
+  const Entry* Find(unsigned key) const {
+    return block_of[key].load(std::memory_order_acquire);
+  }
+
+  Entry* FindOrAdd(unsigned key) {
+    Entry* block = block_of[key].load(std::memory_order_acquire);
+    if (!block) {
+      std::lock_guard<std::mutex> lock(mutex);
+      block = block_of[key].load(std::memory_order_relaxed);
+      if (!block) {
+        unsigned b = nblocks++;
+        auto& chunk = chunks[b / blocks_per_chunk];
+        if (!chunk) chunk.reset(new Entry[size_t(blocks_per_chunk) * width]);
+        block = chunk.get() + size_t(b % blocks_per_chunk) * width;
+        block_of[key].store(block, std::memory_order_release);
+      }
+    }
+    return block;
+  }
+
+  static Stat Get(const Entry* block, unsigned k) {
+    Stat s;
+    if (block) {
+      s.n = block[k].n.load(std::memory_order_relaxed);
+      s.s = block[k].s.load(std::memory_order_relaxed);
+    }
+    return s;
+  }
+
+  static void AddVisit(Entry* block, unsigned k) {
+    block[k].n.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void AddValue(Entry* block, unsigned k, double x) {
+    auto& s = block[k].s;
+    double old = s.load(std::memory_order_relaxed);
+    while (!s.compare_exchange_weak(old, old + x, std::memory_order_relaxed)) {}
+  }
+
+  size_t MemoryUsage() const {
+    size_t allocated = 0;
+    for (auto& chunk : chunks) allocated += chunk ? 1 : 0;
+    return allocated * blocks_per_chunk * width * sizeof(Entry) +
+           chunks.capacity() * sizeof(chunks[0]) +
+           (chunks.size() * blocks_per_chunk) * sizeof(Entry*);
+  }
+};
@@ -6,48 +6,36 @@
 #include "common/geometry/d2/segment.h"
 #include "common/geometry/d2/distance/distance_l2.h"
 #include "common/geometry/d2/utils/inside_segment_polygon.h"
-#include "common/graph/graph_ei.h"
+#include "common/icfpc2021/dislike_tracker.h"
+#include "common/icfpc2021/problem_model.h"
 #include "common/icfpc2021/solution.h"
 #include "common/numeric/utils/abs.h"
 
 #include <algorithm>
 #include <cmath>
-#include <fstream>
-#include <iostream>
-#include <nlohmann/json.hpp>
+#include <memory>
+#include <string>
+#include <vector>
 
 class Task {
 public:
   int eps;
   I2Polygon hole;
-  UndirectedGraphEI<std::pair<int64_t, int64_t>> g;
+  // View of model, no copy of the figure.
+  ProblemModel::Graph g;
   std::vector<I2Point> bonuses_to_unlock;
+  std::shared_ptr<const ProblemModel> model;
 
   void Load(const std::string& filename) {
-    std::ifstream is(filename);
-    nlohmann::json raw;
-    is >> raw;
-    // std::cout << raw << std::endl;
-    eps = raw["epsilon"];
-    auto figure = raw["figure"];
-    unsigned hsize = raw["hole"].size(), fsize = figure["vertices"].size();
-    std::vector<I2Point> vh, vf;
-    for (unsigned i = 0; i < hsize; ++i) vh.push_back({raw["hole"][i][0], raw["hole"][i][1]});
-    hole = I2Polygon(vh);
-    for (unsigned i = 0; i < fsize; ++i) vf.push_back({figure["vertices"][i][0], figure["vertices"][i][1]});
-    g.Resize(fsize);
-    for (auto e : figure["edges"]) {
-      unsigned u0 = e[0], u1 = e[1];
-      auto d = SquaredDistanceL2(vf[u0], vf[u1]);
-      auto dd = (d * eps) / 1000000;
-      g.AddEdge(u0, u1, {d - dd, d + dd});
-    }
-    auto bonuses = raw["bonuses"];
-    for (auto b : bonuses) {
-      auto pos = b["position"];
-      bonuses_to_unlock.push_back({pos[0], pos[1]});
-      // std::cout << "BTU = " << bonuses_to_unlock.back() << std::endl;
-    }
+    Init(ProblemModel::Load(filename));
+  }
+
+  void Init(std::shared_ptr<const ProblemModel> _model) {
+    model = _model;
+    eps = model->eps;
+    hole = I2Polygon(model->hole);
+    g = model->GetGraph();
+    bonuses_to_unlock = model->bonuses;
   }
 
   bool IsValid(const Solution& s) const {
@@ -66,22 +54,20 @@ public:
   }
 
   int64_t Score(const Solution& s) const {
-    int64_t score = 0;
-    for (unsigned i = 0; i < hole.Size(); ++i) {
-      auto p0 = hole[i];
-      int64_t min_d = SquaredDistanceL2(p0, s.points[0]);
-      for (unsigned j = 1; j < s.points.size(); ++j) {
-        int64_t d = SquaredDistanceL2(p0, s.points[j]);
-        min_d = std::min(min_d, d);
-      }
-      score += min_d;
-    }
-    return score;
+    DislikeTracker<I2Point> dislike;
+    dislike.Init(hole.v, s.points);
+    return dislike.Score();
   }
 
   // Raw points in [0, 1] scale without adjusting to best solution
   // and numer of vertexes / edges.
   double RawPoints(const Solution& s) const {
-    return IsValid(s) ? 1.0 / (sqrt(1.0 + Score(s))) : 0.0;
+    return IsValid(s) ? TrustedRawPoints(s) : 0.0;
+  }
+
+  // RawPoints for a solution already known to be valid, e.g. built by a
+  // search that checked every edge; skips the segment checks.
+  double TrustedRawPoints(const Solution& s) const {
+    return 1.0 / (sqrt(1.0 + Score(s)));
   }
 };
@@ -4,18 +4,21 @@
 #include "common/geometry/d2/distance/distance_l2.h"
 #include "common/geometry/d2/point.h"
 #include "common/geometry/d2/segment.h"
-#include "common/geometry/d2/stl_hash/segment.h"
 #include "common/geometry/d2/utils/box.h"
 #include "common/geometry/d2/utils/inside_point_polygon.h"
 #include "common/geometry/d2/utils/inside_segment_polygon.h"
 #include "common/graph/graph_ei.h"
 #include "common/graph/graph_ei/distance_positive_cost.h"
 #include "common/graph/graph_ei/distance_all_pairs_positive_cost.h"
+#include "common/icfpc2021/annulus.h"
+#include "common/icfpc2021/lattice_index.h"
+#include "common/icfpc2021/problem_model.h"
+#include "common/icfpc2021/segment_cache.h"
 #include "common/icfpc2021/task.h"
 #include "common/numeric/utils/usqrt.h"
 
 #include <algorithm>
-#include <unordered_map>
+#include <memory>
 #include <vector>
 
 #include "common/geometry/d2/point_io.h"
@@ -23,64 +26,39 @@
 class TaskCache {
  protected:
   I2Polygon hole;
-  I2ARectangle box;
-  std::vector<std::vector<unsigned>> valid_points_map;
-  std::vector<I2Point> valid_points;
-  std::unordered_map<I2ClosedSegment, bool> valid_segments_map;
+  // Valid points, their index and the reach bounds are views of the shared
+  // problem model.
+  std::shared_ptr<const ProblemModel> model;
+  const ProblemModel::Lattice* lattice = nullptr;
+  // Shared by copies of the cache.
+  std::shared_ptr<SegmentCache> valid_segments;
+  std::shared_ptr<const AnnulusTable> annuli;
+  std::vector<std::vector<unsigned>> edge_annulus;
   // std::unordered_map<I2ClosedSegment, int64_t> segments_hole_distance;
-
- public:
-  std::vector<std::vector<int64_t>> min_distance;
-  std::vector<std::vector<int64_t>> max_distance;
   // std::vector<std::vector<int64_t>> min_hole_distance;
 
  public:
   const std::vector<I2Point>& GetValidPoints() const {
-    return valid_points;
+    return lattice->points;
+  }
+
+  const LatticeIndex& GetValidPointsIndex() const {
+    return lattice->index;
   }
 
   void Init(const Task& task) {
     hole = task.hole;
-    unsigned hsize = hole.Size();
-    box = Box(hole.v);
-    valid_points_map.clear();
-    valid_points_map.resize(box.p2.x - box.p1.x + 1);
-    // Valid points
-    for (unsigned i = 0; i < valid_points_map.size(); ++i) {
-      valid_points_map[i].resize(box.p2.y - box.p1.y + 1, 0);
-      for (unsigned j = 0; j < valid_points_map[i].size(); ++j) {
-        I2Point p0(box.p1.x + i, box.p1.y + j);
-        if (geometry::d2::Inside(p0, hole)) {
-          valid_points_map[i][j] = 1;
-          valid_points.push_back(p0);
-        //   std::cout << p0 << std::endl;
-        }
-      }
-    }
-    // Init min/max distance between vertexes for figure.
-    UndirectedGraphEI<int64_t> gf(task.g.Size());
-    for (unsigned u = 0; u < gf.Size(); ++u) {
-      for (auto e : task.g.EdgesEI(u)) {
-        gf.AddEdge(u, e.to, USqrt(e.info.second - 1) + 1);
-      }
-    }
-    auto vvd = DistanceAllPairsPositiveCost(gf, static_cast<int64_t>(1ll << 30));
-    min_distance.clear();
-    min_distance.resize(gf.Size());
-    max_distance.clear();
-    max_distance.resize(gf.Size());
-    for (unsigned i = 0; i < gf.Size(); ++i) {
-      min_distance[i].resize(gf.Size(), 0);
-      max_distance[i].resize(gf.Size());
-      for (unsigned j = 0; j < gf.Size(); ++j)
-        max_distance[i][j] = vvd[i][j] * vvd[i][j];
-    }
-    for (unsigned u = 0; u < gf.Size(); ++u) {
-      for (auto e : task.g.EdgesEI(u)) {
-        min_distance[u][e.to] = e.info.first;
-        max_distance[u][e.to] = e.info.second;
-      }
+    model = task.model;
+    lattice = &model->GetLattice();
+    valid_segments = std::make_shared<SegmentCache>(lattice->points.size());
+    auto table = std::make_shared<AnnulusTable>();
+    edge_annulus.clear();
+    edge_annulus.resize(task.g.Size());
+    for (unsigned u = 0; u < task.g.Size(); ++u) {
+      for (auto e : task.g.EdgesEI(u))
+        edge_annulus[u].push_back(table->Add(e.info.first, e.info.second));
     }
+    annuli = table;
     // // Init 'hole-distance' from vertexes in the hole
     // UndirectedGraphEI<int64_t> gh(hsize + 1);
     // for (unsigned u = 0; u < hsize; ++u) {
@@ -125,28 +103,90 @@ class TaskCache {
     // }
   }
 
+  // Upper bound of the squared distance between figure vertices u and v.
+  int64_t MaxDistance(unsigned u, unsigned v) const {
+    return model->Reach(u, v);
+  }
+
   unsigned MaxIndex() const {
-      return (box.p2.x - box.p1.x + 1) * (box.p2.y - box.p1.y + 1);
+      return lattice->index.Cells();
   }
 
   unsigned Index(const I2Point& p) const {
-      return (p.x - box.p1.x) + (box.p2.x - box.p1.x + 1) * (p.y - box.p1.y);
+      return lattice->index.Cell(p.x, p.y);
   }
 
   bool CheckPoint(const I2Point& p) const {
-    if (!box.Inside(p)) return false;
-    return valid_points_map[p.x - box.p1.x][p.y - box.p1.y];
+    return lattice->index.Get(p.x, p.y) != LatticeIndex::invalid;
+  }
+
+  const SegmentCache& GetSegmentCache() const { return *valid_segments; }
+
+  // Segment cache plus the lattice of the model. Copies share both, so
+  // count them once.
+  size_t MemoryUsage() const {
+    return valid_segments->MemoryUsage() + lattice->MemoryUsage();
+  }
+
+  // True if every valid point is within squared distance d2 of p.
+  bool DiscCoversAll(const I2Point& p, int64_t d2) const {
+    auto& box = lattice->box;
+    int64_t dx = std::max(p.x - box.p1.x, box.p2.x - p.x);
+    int64_t dy = std::max(p.y - box.p1.y, box.p2.y - p.y);
+    return dx * dx + dy * dy <= d2;
+  }
+
+  // Calls f(begin, end) for the index ranges of the valid points within
+  // squared distance d2 of p, at most one range per column. Only columns
+  // with indices in [first, last) are visited.
+  template <class TCallback>
+  void ForEachInDisc(const I2Point& p, int64_t d2, unsigned first,
+                     unsigned last, TCallback f) const {
+    if ((d2 < 0) || (first >= last)) return;
+    auto& points = lattice->points;
+    auto& column_begin = lattice->column_begin;
+    const int64_t x0 = lattice->box.p1.x;
+    int64_t r = USqrt(d2);
+    int64_t x1 = std::max(p.x - r, points[first].x);
+    int64_t x2 = std::min(p.x + r, points[last - 1].x);
+    for (int64_t x = x1; x <= x2; ++x) {
+      int64_t dy = USqrt(d2 - (x - p.x) * (x - p.x));
+      auto cb = points.begin() + column_begin[x - x0];
+      auto ce = points.begin() + column_begin[x - x0 + 1];
+      auto b = std::lower_bound(
+          cb, ce, p.y - dy,
+          [](const I2Point& q, int64_t y) { return q.y < y; });
+      auto e = std::upper_bound(
+          b, ce, p.y + dy,
+          [](int64_t y, const I2Point& q) { return y < q.y; });
+      if (b < e)
+        f(unsigned(b - points.begin()), unsigned(e - points.begin()));
+    }
+  }
+
+  const AnnulusTable& GetAnnuli() const { return *annuli; }
+
+  // Annulus class of the k-th edge in task.g.EdgesEI(u).
+  unsigned EdgeAnnulus(unsigned u, unsigned k) const {
+    return edge_annulus[u][k];
+  }
+
+  // Calls f(i) for the valid points i at a distance allowed by the k-th
+  // edge of u from p.
+  template <class TCallback>
+  void ForEachInAnnulus(const I2Point& p, unsigned u, unsigned k,
+                        TCallback f) const {
+    annuli->ForEach(lattice->index, p, edge_annulus[u][k], f);
   }
 
-  bool CheckSegmentI(const I2ClosedSegment& s) {
-    auto it = valid_segments_map.find(s);
-    if (it != valid_segments_map.end()) return it->second;
-    bool b = geometry::d2::Inside(s, hole);
-    valid_segments_map.insert({s, b});
-    return b;
+  bool CheckSegmentI(const I2ClosedSegment& s) const {
+    int i1 = lattice->index.Get(s.p1.x, s.p1.y);
+    int i2 = lattice->index.Get(s.p2.x, s.p2.y);
+    if ((i1 < 0) || (i2 < 0)) return geometry::d2::Inside(s, hole);
+    return valid_segments->Get(i1, i2, [&]() { return geometry::d2::Inside(s, hole); });
   }
 
-  bool CheckSegment(const I2ClosedSegment& s) {
+  bool CheckSegment(const I2ClosedSegment& s) const {
     return CheckPoint(s.p1) && CheckPoint(s.p2) && CheckSegmentI(s);
   }
 
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+struct Point {
+    int x, y;
+
+    Point(): x(0), y(0) {}
+
+    Point(int x, int y): x(x), y(y) {}
+
+    Point operator-(const Point& o) const {
+        return {x - o.x, y - o.y};
+    }
+
+    Point operator+(const Point& o) const {
+        return {x + o.x, y + o.y};
+    }
+
+    bool operator==(const Point& o) const {
+        return x == o.x && y == o.y;
+    }
+
+    bool operator!=(const Point& o) const {
+        return (x != o.x) || (y != o.y);
+    }
+
+    int sqrabs() const {
+        return x * x + y * y;
+    }
+
+    bool operator<(const Point& p) const {
+        if (x != p.x) {
+            return x < p.x;
+        }
+        return y < p.y;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& o, const Point& p) {
+    o << "<" << p.x << ", " << p.y << ">";
+    return o;
+}
+
+using Poly = std::vector<Point>;
+
+inline int vmul(const Point& u, const Point& v) {
+    return u.x * v.y - u.y * v.x;
+}
+
+inline int smul(const Point& u, const Point& v) {
+    return u.x * v.x + u.y * v.y;
+}
+
+inline int dist2(Point a, Point b) {
+    return smul(a - b, a - b);
+}
+
+template<typename T>
+T sqr(T x) {
+    return x*x;
+}
+
+template<typename TPoint>
+inline double dist(TPoint a, TPoint b) {
+    return sqrt(sqr(a.x - b.x) + sqr(a.y - b.y));
+}
+
+inline int signum(int a) {
+    return a > 0 ? 1 : a == 0 ? 0 : -1;
+}
+
+inline bool inside(Point p, const Poly& poly) {
+    bool ret = false;
+    for (size_t i = 0; i < poly.size(); ++i) {
+        const auto& u = poly[i];
+        const auto& v = poly[i + 1 == poly.size() ? 0 : i + 1];
+        if (u == p) {
+            return true;
+        }
+        if (u.y == p.y && v.y == p.y && signum(u.x - p.x) * signum(v.x - p.x) <= 0) {
+            return true;
+        }
+        if ((u.y > p.y) != (v.y > p.y)) {
+            int slope = vmul(u - p, v - p);
+            if (slope == 0) {
+                return true;
+            }
+            ret ^= (slope > 0) == (u.y <= p.y);
+        }
+    }
+    return ret;
+}
+
+inline bool isect(Point ua, Point ub, Point va, Point vb) {
+    return
+        signum(vmul(ub - ua, va - ua)) * signum(vmul(ub - ua, vb - ua)) < 0 &&
+        signum(vmul(vb - va, ua - va)) * signum(vmul(vb - va, ub - va)) < 0;
+}
+
+inline bool between(Point a, Point mid, Point b) {
+    auto v1 = a - mid;
+    auto v2 = b - mid;
+    return vmul(v1, v2) == 0 && smul(v1, v2) <= 0;
+}
+
+// Does segment [ua, ub] leave the polygon through edge (poly[i], poly[i + 1])?
+// A segment passing through a vertex is checked against the corner at the end
+// of the edge, so every vertex is handled exactly once.
+inline bool isectEdge(Point ua, Point ub, const Poly& poly, size_t i) {
+    const auto& a = poly[i];
+    const auto& b = poly[i + 1 == poly.size() ? 0 : i + 1];
+    if (between(ua, b, ub)) {
+        const auto& c = poly[i + 2 >= poly.size() ? i + 2 - poly.size() : i + 2];
+        auto interior = [&](Point p) {
+            if (vmul(c - b, a - b) >= 0) {
+                return vmul(c - b, p - b) >= 0 && vmul(p - b, a - b) >= 0;
+            } else {
+                return vmul(c - b, p - b) >= 0 || vmul(p - b, a - b) >= 0;
+            }
+        };
+        return !interior(ua) || !interior(ub);
+    } else if(between(ua, a, ub)) {
+        return false;
+    } else if(between(a, ua, b)) {
+        return vmul(a - b, ub - b) >= 0;
+    } else if(between(a, ub, b)) {
+        return vmul(a - b, ua - b) >= 0;
+    }
+    return isect(ua, ub, a, b);
+}
+
+inline bool isect(Point ua, Point ub, const Poly& poly) {
+    for (size_t i = 0; i < poly.size(); ++i) {
+        if (isectEdge(ua, ub, poly, i)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "replica_exchange.h"
+
+// Online tuning of a ReplicaExchange ladder from its swap acceptance rates.
+//
+// Every call to tune() looks at the swaps since the previous change. The ends
+// of the ladder stay fixed. A pair that almost never swaps gets a chain
+// inserted between its two chains, as long as the ladder is below
+// maxReplicas. A chain that swaps almost always with both neighbours is
+// redundant and is dropped. Otherwise the gaps between neighbouring invT are
+// rescaled towards equal acceptance: a gap that swaps more often than the
+// ladder average is widened, one that swaps less often is narrowed.
+class LadderTuner {
+public:
+    static constexpr uint64_t MIN_PROPOSALS = 200;
+    static constexpr double LOW_RATE = 0.05;
+    static constexpr double HIGH_RATE = 0.9;
+    static constexpr double GAIN = 1.0;
+
+    LadderTuner(ReplicaExchange& engine, std::vector<GibbsChain>& chains, size_t maxReplicas)
+        : engine(engine), chains(chains), maxReplicas(std::max(maxReplicas, size_t(2))) {
+        reset();
+    }
+
+    // Returns true if the ladder was changed.
+    bool tune() {
+        if (chains.size() < 2) {
+            return false;
+        }
+        std::vector<double> rates(chains.size() - 1);
+        for (size_t i = 0; i + 1 < chains.size(); ++i) {
+            const uint64_t proposed = engine.proposed(i) - proposedBase[i];
+            if (proposed < MIN_PROPOSALS) {
+                return false;
+            }
+            rates[i] = 1.0 * (engine.accepted(i) - acceptedBase[i]) / proposed;
+        }
+
+        const size_t worst = std::min_element(rates.begin(), rates.end()) - rates.begin();
+        if (rates[worst] < LOW_RATE && chains.size() < maxReplicas) {
+            engine.paused([&]() { insert(worst); });
+            reset();
+            return true;
+        }
+        for (size_t i = 1; i + 1 < chains.size(); ++i) {
+            if (chains.size() > 2 && rates[i - 1] > HIGH_RATE && rates[i] > HIGH_RATE) {
+                engine.paused([&]() { erase(i); });
+                reset();
+                return true;
+            }
+        }
+
+        double mean = 0.0;
+        for (double r : rates) {
+            mean += r;
+        }
+        mean /= rates.size();
+        std::vector<double> invTs(chains.size());
+        for (size_t i = 0; i < chains.size(); ++i) {
+            invTs[i] = engine.withChain(i, [](GibbsChain& c) { return c.invT; });
+        }
+        std::vector<double> gaps(rates.size());
+        double sum = 0.0;
+        for (size_t i = 0; i < gaps.size(); ++i) {
+            gaps[i] = (invTs[i + 1] - invTs[i]) * std::exp(GAIN * (rates[i] - mean));
+            sum += gaps[i];
+        }
+        const double span = invTs.back() - invTs.front();
+        for (size_t i = 0; i + 2 < chains.size(); ++i) {
+            invTs[i + 1] = invTs[i] + gaps[i] * span / sum;
+            engine.withChain(i + 1, [&](GibbsChain& c) { c.invT = invTs[i + 1]; });
+        }
+        snapshot();
+        return false;
+    }
+
+    void print(std::ostream& os) {
+        for (size_t i = 0; i < chains.size(); ++i) {
+            os << engine.withChain(i, [](GibbsChain& c) { return c.invT; }) << " ";
+        }
+        os << std::endl;
+    }
+
+private:
+    void reset() {
+        proposedBase.assign(chains.size(), 0);
+        acceptedBase.assign(chains.size(), 0);
+    }
+
+    void snapshot() {
+        for (size_t i = 0; i + 1 < chains.size(); ++i) {
+            proposedBase[i] = engine.proposed(i);
+            acceptedBase[i] = engine.accepted(i);
+        }
+    }
+
+    // GibbsChain holds a reference and can't be assigned, so the ladder is
+    // rebuilt instead of calling insert/erase on it.
+    void insert(size_t i) {
+        std::vector<GibbsChain> ladder;
+        for (size_t j = 0; j < chains.size(); ++j) {
+            ladder.push_back(chains[j]);
+            if (j == i) {
+                GibbsChain middle = chains[i + 1];
+                const double lo = chains[i].invT, hi = chains[i + 1].invT;
+                middle.invT = lo > 0 ? std::sqrt(lo * hi) : hi / 2;
+                ladder.push_back(middle);
+            }
+        }
+        chains.swap(ladder);
+    }
+
+    void erase(size_t i) {
+        std::vector<GibbsChain> ladder;
+        for (size_t j = 0; j < chains.size(); ++j) {
+            if (j != i) {
+                ladder.push_back(chains[j]);
+            }
+        }
+        chains.swap(ladder);
+    }
+
+    ReplicaExchange& engine;
+    std::vector<GibbsChain>& chains;
+    size_t maxReplicas;
+    std::vector<uint64_t> proposedBase, acceptedBase;
+};
@@ -1,8 +1,15 @@
 #include "solver.h"
+#include "replica_exchange.h"
+#include "ladder_tuner.h"
 #include <gflags/gflags.h>
 
+#include "common/geometry/d2/location/point_polygon.h"
 #include "common/icfpc2021/solver/bonus_hunting.h"
+#include "common/icfpc2021/solver/full_search.h"
 #include "common/icfpc2021/solver/mctp.h"
+#include "common/icfpc2021/solver/parallel_search.h"
+#include "common/icfpc2021/solver/scheduler.h"
+#include "common/timer.h"
 
 DEFINE_int32(test_idx, 1, "Test number");
 DEFINE_bool(webedit_result, false, "Start from webedit result");
@@ -11,6 +18,17 @@ DEFINE_bool(alex, false, "Alex mode");
 DEFINE_string(init, "", "file from initialization");
 DEFINE_bool(only_border, false, "Only border");
 DEFINE_bool(lazy, false, "Lazy visibility calculation");
+DEFINE_int32(visibility_cache_mb, 0, "Memory cap for lazily computed visibility rows, 0 for no limit");
+DEFINE_bool(compressed_visibility, false, "Keep visibility as compressed rows");
+DEFINE_bool(bench_visibility, false, "Compare dense and compressed visibility and exit");
+DEFINE_bool(bench_preprocess, false, "Compare visibility rows by isect and by VisibilitySweep and exit");
+DEFINE_int32(bench_preprocess_rows, 200, "Source points sampled by --bench_preprocess");
+DEFINE_bool(bench_search, false, "Compare forward checking and arc consistency in exact searches and exit");
+DEFINE_int64(bench_search_nodes, 10000000, "Nodes limit for each search of --bench_search");
+DEFINE_string(precompute_dir, "precompute", "Directory for stored preprocessing results, empty to disable");
+DEFINE_bool(tune_ladder, true, "Adapt temperatures and number of replicas to swap rates");
+DEFINE_int32(cores, std::thread::hardware_concurrency(), "Replica budget shared by both ladders, worker threads in alex mode and --bench_search");
+DEFINE_int32(scheduler_memory_mb, 4096, "Memory for search statistics of problems solved at once in alex mode");
 
 void test_isect() {
     std::vector<Point> poly = {{0, 0}, {-2, -4}, {20, 0}, {-2, 4}};
@@ -30,38 +48,249 @@ void test_isect() {
     // std::cerr << Line({0, 0}, {0, 1}).reflect({1, 0}) << std::endl;
 }
 
-void CommonSolve(unsigned index, unsigned max_time) {
-  std::string input = "problems/" + std::to_string(index) + ".json";
+void test_visibility() {
+    std::vector<Poly> polys = {
+        {{0, 0}, {-2, -4}, {20, 0}, {-2, 4}},
+        {{0, 0}, {6, 0}, {6, 6}, {4, 6}, {4, 2}, {3, 2}, {2, 2}, {2, 6}, {0, 6}, {0, 3}},
+        {{0, 0}, {4, 0}, {4, 2}, {6, 2}, {6, 0}, {10, 0}, {10, 6}, {7, 6}, {7, 3}, {3, 3}, {3, 6}, {0, 6}},
+        {{0, 0}, {8, 0}, {8, 4}, {6, 2}, {4, 4}, {2, 2}, {0, 4}},
+    };
+    for (const auto& poly : polys) {
+        std::vector<Point> points;
+        for (int x = -5; x <= 25; ++x) {
+            for (int y = -5; y <= 10; ++y) {
+                if (inside({x, y}, poly)) {
+                    points.emplace_back(x, y);
+                }
+            }
+        }
+        VisibilitySweep sweep(poly, points);
+        for (size_t i = 0; i < points.size(); ++i) {
+            boost::dynamic_bitset<> bs(points.size());
+            size_t last = 0;
+            bool first = true;
+            sweep.sweep(i, 0, points.size(), [&](size_t j) {
+                // Compressed rows rely on increasing order.
+                assert(first || j > last);
+                first = false;
+                last = j;
+                bs.set(j);
+            });
+            for (size_t j = 0; j < points.size(); ++j) {
+                assert(bs[j] == !isect(points[i], points[j], poly));
+            }
+        }
+    }
+}
+
+// Locate against the winding number from summed angles, on polygons where the
+// ray from many points runs through vertices or along horizontal edges.
+void test_locate() {
+    using geometry::d2::location::Location;
+    std::vector<std::vector<I2Point>> polys = {
+        {{0, 0}, {-2, -4}, {20, 0}, {-2, 4}},
+        {{0, 0}, {6, 0}, {6, 6}, {4, 6}, {4, 2}, {3, 2}, {2, 2}, {2, 6}, {0, 6}, {0, 3}},
+        {{0, 0}, {4, 0}, {4, 2}, {6, 2}, {6, 0}, {10, 0}, {10, 6}, {7, 6}, {7, 3}, {3, 3}, {3, 6}, {0, 6}},
+        {{0, 0}, {8, 0}, {8, 4}, {6, 2}, {4, 4}, {2, 2}, {0, 4}},
+        {{0, 2}, {2, 0}, {4, 2}, {6, 0}, {8, 2}, {6, 4}, {4, 2}, {2, 4}},
+    };
+    for (auto v : polys) {
+        for (int reversed = 0; reversed < 2; ++reversed) {
+            if (reversed) {
+                std::reverse(v.begin(), v.end());
+            }
+            I2Polygon poly(v);
+            for (int64_t x = -4; x <= 24; ++x) {
+                for (int64_t y = -6; y <= 8; ++y) {
+                    const I2Point p(x, y);
+                    Location::Type expected = Location::OUTSIDE;
+                    double angle = 0;
+                    for (size_t i = 0; i < v.size(); ++i) {
+                        const I2Point a = v[i], b = v[(i + 1) % v.size()];
+                        const int64_t cross = (a.x - x) * (b.y - y) - (a.y - y) * (b.x - x);
+                        const int64_t dot = (a.x - x) * (b.x - x) + (a.y - y) * (b.y - y);
+                        if (a == p) {
+                            expected = Location::VERTEX;
+                            break;
+                        }
+                        if (cross == 0 && dot < 0) {
+                            expected = Location::EDGE;
+                        }
+                        angle += std::atan2(double(cross), double(dot));
+                    }
+                    if (expected == Location::OUTSIDE && std::abs(angle) > M_PI) {
+                        expected = Location::INSIDE;
+                    }
+                    assert(geometry::d2::location::Locate(p, poly).type == expected);
+                }
+            }
+        }
+    }
+}
+
+void bench_visibility(std::shared_ptr<const ProblemModel> model) {
+    Problem dense, compressed;
+    dense.init(model);
+    dense.preprocess(true, false, "");
+    compressed.init(model);
+    compressed.compressedVisibility = true;
+    compressed.preprocess(true, false, "");
+
+    const size_t n = dense.pointsInside.size();
+    size_t denseBytes = 0, compressedBytes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        denseBytes += sizeof(dense.visibility[i]) + dense.visibility[i].num_blocks() * sizeof(boost::dynamic_bitset<>::block_type);
+        compressedBytes += compressed.compressedRows[i].bytes();
+    }
+    std::cerr << "memory: dense " << denseBytes / 1024 << " KiB, compressed " << compressedBytes / 1024 << " KiB" << std::endl;
+
+    // Same source sets as GibbsChain::step sees: the images of a vertex's neighbours.
+    constexpr int ITERATIONS = 20000;
+    std::uniform_int_distribution<int> pointDistr(0, n - 1);
+    for (int arity : {1, 2, 3, 4}) {
+        std::vector<std::vector<int>> queries(ITERATIONS);
+        for (auto& q : queries) {
+            for (int k = 0; k < arity; ++k) {
+                q.push_back(pointDistr(gen));
+            }
+        }
+        boost::dynamic_bitset<> candidates;
+        size_t denseCount = 0, compressedCount = 0;
+        Timer t;
+        for (const auto& q : queries) {
+            dense.intersectVisibility(q, candidates);
+            denseCount += candidates.count();
+        }
+        const auto denseTime = t.GetMicroseconds();
+        t.Start();
+        for (const auto& q : queries) {
+            compressed.intersectVisibility(q, candidates);
+            compressedCount += candidates.count();
+        }
+        const auto compressedTime = t.GetMicroseconds();
+        assert(denseCount == compressedCount);
+        std::cerr << arity << "-row AND: dense " << 1000.0 * denseTime / ITERATIONS << " ns, compressed "
+                  << 1000.0 * compressedTime / ITERATIONS << " ns" << std::endl;
+    }
+}
+
+// Visibility rows of evenly spaced sources, by isect() against every target
+// as calcVisibility did before VisibilitySweep, and by the sweep. Prints the
+// time per row and the estimate for all P rows on one thread.
+void bench_preprocess(std::shared_ptr<const ProblemModel> model) {
+    Problem p;
+    p.init(model);
+    p.preprocess(false, false, "");
+    const size_t n = p.pointsInside.size();
+    const size_t samples = std::min<size_t>(n, FLAGS_bench_preprocess_rows);
+    boost::dynamic_bitset<> naive(n), swept(n);
+    size_t naiveTime = 0, sweptTime = 0;
+    Timer t;
+    for (size_t s = 0; s < samples; ++s) {
+        const size_t i = s * n / samples;
+        naive.reset();
+        swept.reset();
+        t.Start();
+        for (size_t j = 0; j < n; ++j) {
+            if (!isect(p.pointsInside[i], p.pointsInside[j], p.hole)) {
+                naive.set(j);
+            }
+        }
+        naiveTime += t.GetMicroseconds();
+        t.Start();
+        p.visibilitySweep.calc(i, swept);
+        sweptTime += t.GetMicroseconds();
+        assert(naive == swept);
+    }
+    std::cerr << "P " << n << ", H " << p.hole.size() << ", " << samples << " rows: isect "
+              << 1e-3 * naiveTime / samples << " ms/row, sweep " << 1e-3 * sweptTime / samples << " ms/row; all rows: isect "
+              << 1e-6 * naiveTime / samples * n << " s, sweep " << 1e-6 * sweptTime / samples * n << " s" << std::endl;
+}
+
+void bench_search(std::shared_ptr<const ProblemModel> model) {
+    Task t;
+    t.Init(model);
+    auto run = [&](const std::string& name, auto& search, bool arcConsistency) {
+        search.SetArcConsistency(arcConsistency);
+        search.SetNodesLimit(FLAGS_bench_search_nodes);
+        Timer timer;
+        const bool found = search.Search();
+        std::cerr << name << (arcConsistency ? " ac3: " : " fc:  ")
+                  << (found ? "found" : search.Aborted() ? "aborted" : "none") << ", " << search.Nodes() << " nodes, "
+                  << timer.GetMilliseconds() << " ms, segment cache " << search.GetCache().GetSegmentCache().Hits()
+                  << " hits " << search.GetCache().GetSegmentCache().Misses() << " misses" << std::endl;
+    };
+    for (bool arcConsistency : {false, true}) {
+        solver::FullSearch search(t);
+        run("FullSearch", search, arcConsistency);
+    }
+    for (bool arcConsistency : {false, true}) {
+        solver::PerfectScore search(t);
+        run("PerfectScore", search, arcConsistency);
+    }
+    auto runParallel = [&](const std::string& name, auto& prototype) {
+        solver::ParallelSearch<std::decay_t<decltype(prototype)>> search(prototype, std::max(FLAGS_cores, 1));
+        Timer timer;
+        const bool found = search.Search();
+        std::cerr << name << " parallel: " << (found ? "found" : "none") << ", " << search.Nodes() << " nodes, "
+                  << timer.GetMilliseconds() << " ms" << std::endl;
+    };
+    {
+        solver::FullSearch prototype(t);
+        runParallel("FullSearch", prototype);
+    }
+    {
+        solver::PerfectScore prototype(t);
+        runParallel("PerfectScore", prototype);
+    }
+}
+
+void CommonSolve(std::shared_ptr<const ProblemModel> model, unsigned index, unsigned max_time) {
   Task t;
-  t.Load(input);
+  t.Init(model);
   // solver::BonusHunting slvr(t, index);
   solver::MCTP slvr(t, index, max_time);
-  slvr.Search();
+  slvr.Search(std::max(FLAGS_cores, 1));
 }
 
 void CommonSolve(unsigned max_time) {
-  for (unsigned i = 1; i <= 132; ++i) {
-    std::cout << "Solving problem " << i << std::endl;
-    CommonSolve(i, max_time);
-  }
+  solver::Scheduler scheduler(1, 132, max_time, "submitter/scores.csv",
+                              static_cast<size_t>(FLAGS_scheduler_memory_mb) << 20);
+  scheduler.Run(std::max(FLAGS_cores, 1));
 }
 
 int main(int argc, char** argv) {
     test_isect();
+    test_locate();
+    test_visibility();
     gflags::ParseCommandLineFlags(&argc, &argv, true);
     std::cerr << FLAGS_test_idx << " ";
     auto fn = "problems/" + std::to_string(FLAGS_test_idx) + ".json";
+    if (FLAGS_bench_search) {
+        bench_search(ProblemModel::Load(fn));
+        return 0;
+    }
     if (FLAGS_alex) {
         if (FLAGS_test_idx) {
-            CommonSolve(FLAGS_test_idx, 1200);
+            CommonSolve(ProblemModel::Load(fn), FLAGS_test_idx, 1200);
         } else {
             CommonSolve(60);
         }
         return 0;
     } else {
+        if (FLAGS_bench_visibility) {
+            bench_visibility(ProblemModel::Load(fn));
+            return 0;
+        }
+        if (FLAGS_bench_preprocess) {
+            bench_preprocess(ProblemModel::Load(fn));
+            return 0;
+        }
         Problem p;
-        p.parseJson(fn);
-        p.preprocess(!FLAGS_lazy, FLAGS_only_border);
+        p.init(ProblemModel::Load(fn));
+        p.compressedVisibility = FLAGS_compressed_visibility;
+        p.visibilityCacheBytes = static_cast<size_t>(FLAGS_visibility_cache_mb) << 20;
+        p.preprocess(!FLAGS_lazy, FLAGS_only_border, FLAGS_precompute_dir);
         // p.recSolve2();
         std::vector<double> invTs{0.0, 2.2, 5.0, 10.0, 20.0, 40.0, 100.0, 300.0, 50000.0};
         // std::vector<double> invTs{0.0, 0.05, 0.1, 0.2, 0.3, 0.4, 0.6, 0.9, 1.5, 2.5, 5.0, 10.0};
@@ -140,109 +369,106 @@ int main(int argc, char** argv) {
         for (auto& mcmc : mcmcs) {
             mcmc.init(sol0);
         }
-        std::vector<double> stats(invTs.size() - 1, 0.0);
-        std::vector<double> avgE(invTs.size(), 0.0);
-        std::vector<double> statsFeasible(invTsFeasible.size() - 1, 0.0);
-        std::vector<double> avgEFeasible(invTsFeasible.size(), 0.0);
         double minOptE = 1e100;
-        for (int it = 0;; it++) {
-            if (it % 1000 == 0) {
-                std::cerr << it << std::endl;
-                for (double x : stats) {
-                    std::cerr << (x / 1000.0) << " ";
-                }
-                std::cerr << std::endl;
-                stats.assign(stats.size(), 0.0);
-                for (double x : avgE) {
-                    std::cerr << (x / 1000.0) << " ";
-                }
-                std::cerr << std::endl;
-                avgE.assign(avgE.size(), 0.0);
-                for (double x : statsFeasible) {
-                    std::cerr << (x / 1000.0) << " ";
-                }
-                std::cerr << std::endl;
-                statsFeasible.assign(statsFeasible.size(), 0.0);
-                for (double x : avgEFeasible) {
-                    std::cerr << (x / 1000.0) << " ";
-                }
-                std::cerr << std::endl;
-                avgEFeasible.assign(avgEFeasible.size(), 0.0);
-            }
-            auto dojob = [&](int i) {
-                auto& mcmc = mcmcs[i];
-                mcmc.step();
-            };
-            std::vector<std::future<void>> fs;
-            for (size_t i = 0; i < mcmcs.size(); ++i) {
-                fs.emplace_back(std::async(std::launch::async, dojob, i));
-            }
-            if (mcmcsFeasible[0].initialized) {
-                auto dojobFeasible = [&](int i) {
-                    auto& mcmc = mcmcsFeasible[i];
-                    mcmc.step();
-                };
-                std::vector<std::future<void>> fsFeasible;
-                for (size_t i = 0; i < mcmcsFeasible.size(); ++i) {
-                    fsFeasible.emplace_back(std::async(std::launch::async, dojobFeasible, i));
+        std::mutex best;
+        auto saveBest = [&](const SolutionCandidate& sc, const std::string& tag) {
+            std::lock_guard<std::mutex> lock(best);
+            if (sc.optE < minOptE) {
+                minOptE = sc.optE;
+                std::cerr << tag << sc.constE << " " << sc.optE << "\n";
+                std::ofstream f("solutions/staging/" + std::to_string(FLAGS_test_idx) + ".json");
+                f << p.exportSol(sc.points);
+            }
+        };
+        ReplicaExchange feasible(mcmcsFeasible, [&](size_t i, GibbsChain& mcmc) {
+            saveBest(mcmc.current, "f" + std::to_string(i) + " ");
+        });
+        std::once_flag feasibleInit;
+        ReplicaExchange relaxed(mcmcs, [&](size_t i, GibbsChain& mcmc) {
+            if (mcmc.current.constE != 0.0) {
+                return;
+            }
+            saveBest(mcmc.current, "");
+            bool initialized = false;
+            std::call_once(feasibleInit, [&]() {
+                for (auto& mcmcFeasible : mcmcsFeasible) {
+                    mcmcFeasible.init(mcmc.current);
                 }
-                for (size_t i = 0; i < mcmcsFeasible.size(); ++i) {
-                    auto& mcmc = mcmcsFeasible[i];
-                    fsFeasible[i].wait();
-                    avgEFeasible[i] += mcmc.current.optE;
-                    if (mcmc.current.optE < minOptE) {
-                        minOptE = mcmc.current.optE;
-                        std::cerr << "f" << i << " " << mcmc.current.constE << " " << mcmc.current.optE << "\n";
-                        std::ofstream f("solutions/staging/" + std::to_string(FLAGS_test_idx) + ".json");
-                        f << p.exportSol(mcmc.current.points);
-                        // return 0;
-                    }
+                feasible.start();
+                initialized = true;
+            });
+            if (!initialized && i == mcmcs.size() - 1) {
+                feasible.withChain(0, [&](GibbsChain& mcmcFeasible) { std::swap(mcmc.current, mcmcFeasible.current); });
+            }
+        });
+        relaxed.start();
+
+        auto report = [](ReplicaExchange& engine, std::vector<uint64_t>& proposed, std::vector<uint64_t>& accepted,
+                         bool feasibleEnergy) {
+            for (size_t i = 0; i + 1 < engine.size(); ++i) {
+                const uint64_t dp = engine.proposed(i) - proposed[i], da = engine.accepted(i) - accepted[i];
+                proposed[i] += dp;
+                accepted[i] += da;
+                std::cerr << (dp ? 1.0 * da / dp : 0.0) << " ";
+            }
+            std::cerr << std::endl;
+            for (size_t i = 0; i < engine.size(); ++i) {
+                std::cerr << engine.withChain(i, [&](GibbsChain& mcmc) {
+                    return feasibleEnergy ? mcmc.current.optE : mcmc.current.constE;
+                }) << " ";
+            }
+            std::cerr << std::endl;
+        };
+        // Each ladder may grow to its share of the core budget, but is never
+        // forced below its initial size.
+        const size_t cores = std::max(FLAGS_cores, 1);
+        const size_t replicas = invTs.size() + invTsFeasible.size();
+        LadderTuner tuner(relaxed, mcmcs, std::max(invTs.size(), cores * invTs.size() / replicas));
+        LadderTuner tunerFeasible(feasible, mcmcsFeasible,
+                                  std::max(invTsFeasible.size(), cores * invTsFeasible.size() / replicas));
+        std::vector<uint64_t> proposed(invTs.size(), 0), accepted(invTs.size(), 0);
+        std::vector<uint64_t> proposedFeasible(invTsFeasible.size(), 0), acceptedFeasible(invTsFeasible.size(), 0);
+        for (uint64_t reported = 0;;) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (FLAGS_tune_ladder) {
+                // Pair counters restart from zero when a ladder changes its size.
+                if (tuner.tune()) {
+                    proposed.assign(relaxed.size(), 0);
+                    accepted.assign(relaxed.size(), 0);
+                    reported = 0;
+                    std::cerr << "ladder ";
+                    tuner.print(std::cerr);
                 }
-                for (size_t i = 0; i < mcmcsFeasible.size() - 1; ++i) {
-                    auto& c1 = mcmcsFeasible[i];
-                    auto& c2 = mcmcsFeasible[i + 1];
-                    double p = std::min(
-                        1.0, std::exp((c1.E(c1.current) + c2.E(c2.current)) - (c1.E(c2.current) + c2.E(c1.current))));
-                    if (std::uniform_real_distribution()(gen) <= p) {
-                        statsFeasible[i]++;
-                        std::swap(c1.current, c2.current);
-                    }
+                if (feasible.started() && tunerFeasible.tune()) {
+                    proposedFeasible.assign(feasible.size(), 0);
+                    acceptedFeasible.assign(feasible.size(), 0);
+                    std::cerr << "feasible ladder ";
+                    tunerFeasible.print(std::cerr);
                 }
             }
-            for (size_t i = 0; i < mcmcs.size(); ++i) {
-                auto& mcmc = mcmcs[i];
-                fs[i].wait();
-                avgE[i] += mcmc.current.constE;
-                if (mcmc.current.constE == 0.0) {
-                    if (mcmc.current.optE < minOptE) {
-                        minOptE = mcmc.current.optE;
-                        std::cerr << mcmc.current.constE << " " << mcmc.current.optE << "\n";
-                        std::ofstream f("solutions/staging/" + std::to_string(FLAGS_test_idx) + ".json");
-                        f << p.exportSol(mcmc.current.points);
-                    }
-                    // return 0;
-                    if (!mcmcsFeasible[0].initialized) {
-                        for (auto& mcmcFeasible : mcmcsFeasible) {
-                            mcmcFeasible.init(mcmc.current);
-                        }
-                    } else if (i == mcmcs.size() - 1) {
-                        std::swap(mcmc.current, mcmcsFeasible[0].current);
+            const uint64_t it = relaxed.steps(0);
+            if (it >= reported + 1000) {
+                reported = it;
+                std::cerr << it << std::endl;
+                report(relaxed, proposed, accepted, false);
+                if (FLAGS_tune_ladder) {
+                    tuner.print(std::cerr);
+                }
+                if (feasible.started()) {
+                    report(feasible, proposedFeasible, acceptedFeasible, true);
+                    if (FLAGS_tune_ladder) {
+                        tunerFeasible.print(std::cerr);
                     }
                 }
             }
-            for (size_t i = 0; i < mcmcs.size() - 1; ++i) {
-                auto& c1 = mcmcs[i];
-                auto& c2 = mcmcs[i + 1];
-                double p = std::min(
-                    1.0, std::exp((c1.E(c1.current) + c2.E(c2.current)) - (c1.E(c2.current) + c2.E(c1.current))));
-                if (std::uniform_real_distribution()(gen) <= p) {
-                    stats[i]++;
-                    std::swap(c1.current, c2.current);
-                }
+            bool noSolution;
+            {
+                std::lock_guard<std::mutex> lock(best);
+                noSolution = minOptE == 1e100;
             }
-            if (minOptE == 1e100) {
+            if (noSolution) {
                 std::ofstream f("solutions/debug/" + std::to_string(FLAGS_test_idx) + ".json");
-                f << p.exportSol(mcmcs.back().current.points);
+                f << p.exportSol(relaxed.withChain(mcmcs.size() - 1, [](GibbsChain& mcmc) { return mcmc.current.points; }));
             }
         }
     }
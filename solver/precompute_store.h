@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/dynamic_bitset.hpp>
+
+#include "geometry.h"
+
+// On-disk snapshot of Problem::preprocess: lattice points, the distance
+// matrix g and, optionally, the visibility matrix. One file per problem,
+// named after a hash of the problem JSON, so an edited problem never picks
+// up stale data. The file is mapped read-only and validated against the
+// header. Points and g are copied out; visibility rows are read in place
+// from the mapping, so loading does not touch them and the kernel pages in
+// only the rows that are used.
+//
+// Layout: Header, int32 points[2 * numPoints], uint8 isCorner[numPoints]
+// (padded to 8 bytes), double g[numVertices * numVertices], then
+// numPoints * blocksPerRow visibility blocks if hasVisibility is set.
+class PrecomputeStore {
+public:
+    // 2: g is the symmetric reach bound of ProblemModel.
+    static constexpr uint32_t VERSION = 2;
+
+    using Block = boost::dynamic_bitset<>::block_type;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t blockSize;
+        uint64_t sourceHash;
+        uint64_t numPoints;
+        uint64_t numVertices;
+        uint64_t blocksPerRow;
+        uint64_t hasVisibility;
+    };
+
+    // FNV-1a over the raw problem file.
+    static uint64_t hash(const std::string& data) {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : data) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static std::string fileName(const std::string& dir, uint64_t sourceHash) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(sourceHash));
+        return dir + "/" + buf + ".bin";
+    }
+
+    PrecomputeStore() = default;
+    PrecomputeStore(const PrecomputeStore&) = delete;
+    PrecomputeStore& operator=(const PrecomputeStore&) = delete;
+
+    ~PrecomputeStore() {
+        close();
+    }
+
+    void close() {
+        if (data) {
+            munmap(data, size);
+            data = nullptr;
+        }
+    }
+
+    // Maps the file and checks that it was built from the same problem by
+    // this version of the code.
+    bool open(const std::string& fn, uint64_t sourceHash, size_t numVertices) {
+        close();
+        int fd = ::open(fn.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<char*>(mapped);
+        const Header& h = header();
+        if (std::memcmp(h.magic, MAGIC, sizeof(h.magic)) != 0 || h.version != VERSION ||
+            h.blockSize != sizeof(Block) || h.sourceHash != sourceHash || h.numVertices != numVertices ||
+            size != fileSize(h)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    const Header& header() const {
+        return *reinterpret_cast<const Header*>(data);
+    }
+
+    std::vector<Point> points() const {
+        const int32_t* raw = reinterpret_cast<const int32_t*>(data + pointsOffset());
+        std::vector<Point> result(header().numPoints);
+        for (size_t i = 0; i < result.size(); ++i) {
+            result[i] = {raw[2 * i], raw[2 * i + 1]};
+        }
+        return result;
+    }
+
+    std::vector<uint8_t> isCorner() const {
+        const uint8_t* raw = reinterpret_cast<const uint8_t*>(data + cornersOffset(header()));
+        return {raw, raw + header().numPoints};
+    }
+
+    std::vector<std::vector<double>> distances() const {
+        const double* raw = reinterpret_cast<const double*>(data + distancesOffset(header()));
+        const size_t n = header().numVertices;
+        std::vector<std::vector<double>> result(n);
+        for (size_t i = 0; i < n; ++i) {
+            result[i].assign(raw + i * n, raw + (i + 1) * n);
+        }
+        return result;
+    }
+
+    // Row i of the stored visibility matrix, blocksPerRow blocks inside the
+    // mapping. Valid while the store stays open.
+    const Block* visibilityBlocks(size_t i) const {
+        const Header& h = header();
+        return reinterpret_cast<const Block*>(data + visibilityOffset(h)) + i * h.blocksPerRow;
+    }
+
+    bool visible(size_t i, size_t j) const {
+        constexpr size_t BITS = boost::dynamic_bitset<>::bits_per_block;
+        return (visibilityBlocks(i)[j / BITS] >> (j % BITS)) & 1;
+    }
+
+    void visibilityRow(size_t i, boost::dynamic_bitset<>& bs) const {
+        const Block* raw = visibilityBlocks(i);
+        bs.clear();
+        bs.append(raw, raw + header().blocksPerRow);
+        bs.resize(header().numPoints);
+    }
+
+    // candidates = AND of the given rows, read from the mapping. Only the
+    // result is copied into the bitset.
+    void intersectVisibility(const std::vector<int>& rows, boost::dynamic_bitset<>& candidates) const {
+        const Header& h = header();
+        if (rows.empty()) {
+            candidates.resize(h.numPoints);
+            candidates.set();
+            return;
+        }
+        std::vector<Block> acc(visibilityBlocks(rows[0]), visibilityBlocks(rows[0]) + h.blocksPerRow);
+        for (size_t r = 1; r < rows.size(); ++r) {
+            const Block* raw = visibilityBlocks(rows[r]);
+            for (size_t b = 0; b < acc.size(); ++b) {
+                acc[b] &= raw[b];
+            }
+        }
+        candidates.clear();
+        candidates.append(acc.begin(), acc.end());
+        candidates.resize(h.numPoints);
+    }
+
+    // Writes to a temporary file first, so a concurrent reader either sees
+    // the complete artifact or none at all.
+    static bool write(const std::string& fn, uint64_t sourceHash, const std::vector<Point>& points,
+                      const std::vector<uint8_t>& isCorner, const std::vector<std::vector<double>>& g,
+                      const std::vector<boost::dynamic_bitset<>>* visibility) {
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(fn).parent_path(), ec);
+        Header h;
+        std::memcpy(h.magic, MAGIC, sizeof(h.magic));
+        h.version = VERSION;
+        h.blockSize = sizeof(Block);
+        h.sourceHash = sourceHash;
+        h.numPoints = points.size();
+        h.numVertices = g.size();
+        h.blocksPerRow = (points.size() + boost::dynamic_bitset<>::bits_per_block - 1) /
+                         boost::dynamic_bitset<>::bits_per_block;
+        h.hasVisibility = visibility != nullptr;
+
+        const std::string tmp = fn + ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream os(tmp, std::ios::binary);
+            if (!os) {
+                return false;
+            }
+            os.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            for (const auto& p : points) {
+                int32_t xy[2] = {p.x, p.y};
+                os.write(reinterpret_cast<const char*>(xy), sizeof(xy));
+            }
+            os.write(reinterpret_cast<const char*>(isCorner.data()), isCorner.size());
+            const char pad[8] = {};
+            os.write(pad, padded(isCorner.size()) - isCorner.size());
+            for (const auto& row : g) {
+                os.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(double));
+            }
+            if (visibility) {
+                std::vector<Block> blocks;
+                for (const auto& row : *visibility) {
+                    blocks.clear();
+                    boost::to_block_range(row, std::back_inserter(blocks));
+                    os.write(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(Block));
+                }
+            }
+            if (!os) {
+                std::remove(tmp.c_str());
+                return false;
+            }
+        }
+        return std::rename(tmp.c_str(), fn.c_str()) == 0;
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'I', 'C', 'F', 'P', 'P', 'R', 'E', '\0'};
+
+    static size_t padded(size_t n) {
+        return (n + 7) / 8 * 8;
+    }
+
+    static size_t pointsOffset() {
+        return sizeof(Header);
+    }
+
+    static size_t cornersOffset(const Header& h) {
+        return pointsOffset() + h.numPoints * 2 * sizeof(int32_t);
+    }
+
+    static size_t distancesOffset(const Header& h) {
+        return cornersOffset(h) + padded(h.numPoints);
+    }
+
+    static size_t visibilityOffset(const Header& h) {
+        return distancesOffset(h) + h.numVertices * h.numVertices * sizeof(double);
+    }
+
+    static size_t fileSize(const Header& h) {
+        return visibilityOffset(h) + (h.hasVisibility ? h.numPoints * h.blocksPerRow * sizeof(Block) : 0);
+    }
+
+    char* data = nullptr;
+    size_t size = 0;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "solver.h"
+
+// Parallel tempering over a ladder of GibbsChains ordered by invT.
+//
+// Every chain lives on its own long-lived worker. After each sweep a worker
+// proposes to exchange states with the next chain of the ladder, holding
+// only the locks of these two chains, so chains never wait for the whole
+// ladder. Acceptance is counted per neighbouring pair.
+//
+// The ladder itself (temperatures and number of chains) can be changed while
+// the workers are paused, see LadderTuner.
+class ReplicaExchange {
+public:
+    // Called by the worker of chain i after every sweep, with the chain locked.
+    using StepCallback = std::function<void(size_t i, GibbsChain& chain)>;
+
+    ReplicaExchange(std::vector<GibbsChain>& chains, StepCallback onStep = {})
+        : chains(chains), onStep(std::move(onStep)), replicas(new Replica[chains.size()]) {
+    }
+
+    ~ReplicaExchange() {
+        stop();
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(control);
+        startWorkers();
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(control);
+        stopWorkers();
+    }
+
+    // Runs f() with all workers stopped; f may change the chains vector.
+    // Counters of all pairs start from zero afterwards.
+    template <class F>
+    void paused(F&& f) {
+        std::lock_guard<std::mutex> lock(control);
+        const bool wasRunning = running;
+        stopWorkers();
+        {
+            std::unique_lock<std::shared_mutex> layoutLock(layout);
+            f();
+            replicas.reset(new Replica[chains.size()]);
+        }
+        if (wasRunning) {
+            startWorkers();
+        }
+    }
+
+    bool started() const {
+        return running;
+    }
+
+    size_t size() const {
+        return chains.size();
+    }
+
+    uint64_t steps(size_t i) const {
+        return replicas[i].steps;
+    }
+
+    // Swaps proposed and accepted between chains i and i + 1.
+    uint64_t proposed(size_t i) const {
+        return replicas[i].proposed;
+    }
+
+    uint64_t accepted(size_t i) const {
+        return replicas[i].accepted;
+    }
+
+    // Runs f(chain) with chain i locked.
+    template <class F>
+    auto withChain(size_t i, F&& f) {
+        std::shared_lock<std::shared_mutex> layoutLock(layout);
+        std::lock_guard<std::mutex> lock(replicas[i].lock);
+        return f(chains[i]);
+    }
+
+private:
+    struct Replica {
+        std::mutex lock;
+        std::atomic<uint64_t> steps = 0;
+        std::atomic<uint64_t> proposed = 0;
+        std::atomic<uint64_t> accepted = 0;
+        std::atomic<int> waiting = 0;
+    };
+
+    void startWorkers() {
+        if (running) {
+            return;
+        }
+        stopping = false;
+        for (size_t i = 0; i < chains.size(); ++i) {
+            workers.emplace_back(&ReplicaExchange::work, this, i);
+        }
+        running = true;
+    }
+
+    void stopWorkers() {
+        stopping = true;
+        for (auto& w : workers) {
+            w.join();
+        }
+        workers.clear();
+        running = false;
+    }
+
+    void work(size_t i) {
+        std::mt19937 rng(std::random_device{}());
+        uint64_t neighbourSteps = 0;
+        while (!stopping) {
+            // Hand the lock over to a neighbour waiting to propose a swap;
+            // otherwise this worker would re-acquire it right away.
+            while (replicas[i].waiting && !stopping) {
+                std::this_thread::yield();
+            }
+            {
+                std::lock_guard<std::mutex> lock(replicas[i].lock);
+                chains[i].step();
+                if (onStep) {
+                    onStep(i, chains[i]);
+                }
+                ++replicas[i].steps;
+            }
+            // Propose only after the neighbour has moved since the last proposal, so
+            // that a fast worker does not keep its neighbour locked out.
+            if (i + 1 < chains.size() && replicas[i + 1].steps != neighbourSteps) {
+                ++replicas[i + 1].waiting;
+                std::scoped_lock lock(replicas[i].lock, replicas[i + 1].lock);
+                --replicas[i + 1].waiting;
+                neighbourSteps = replicas[i + 1].steps;
+                auto& c1 = chains[i];
+                auto& c2 = chains[i + 1];
+                double p = std::min(
+                    1.0, std::exp((c1.E(c1.current) + c2.E(c2.current)) - (c1.E(c2.current) + c2.E(c1.current))));
+                ++replicas[i].proposed;
+                if (std::uniform_real_distribution()(rng) <= p) {
+                    ++replicas[i].accepted;
+                    std::swap(c1.current, c2.current);
+                }
+            }
+        }
+    }
+
+    std::vector<GibbsChain>& chains;
+    StepCallback onStep;
+    std::unique_ptr<Replica[]> replicas;
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopping = false;
+    std::atomic<bool> running = false;
+    std::mutex control;
+    std::shared_mutex layout;
+};
@@ -1,16 +1,31 @@
+#pragma once
+
 #include <cstddef>
+#include <cmath>
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <future>
 #include <random>
-#include <map>
+#include <thread>
 
 #include <boost/dynamic_bitset.hpp>
 #include <nlohmann/json.hpp>
 
+#include "common/icfpc2021/annulus.h"
+#include "common/icfpc2021/dislike_tracker.h"
+#include "common/icfpc2021/lattice_index.h"
+#include "common/icfpc2021/problem_model.h"
+
+#include "geometry.h"
+#include "precompute_store.h"
+#include "visibility.h"
+#include "visibility_cache.h"
+#include "visibility_rows.h"
+
 using json = nlohmann::json;
 
 namespace {
@@ -18,141 +33,6 @@ std::random_device r;
 std::mt19937 gen(r());
 }  // namespace
 
-struct Point {
-    int x, y;
-
-    Point(): x(0), y(0) {}
-
-    Point(int x, int y): x(x), y(y) {}
-
-    Point operator-(const Point& o) const {
-        return {x - o.x, y - o.y};
-    }
-
-    Point operator+(const Point& o) const {
-        return {x + o.x, y + o.y};
-    }
-
-    bool operator==(const Point& o) const {
-        return x == o.x && y == o.y;
-    }
-
-    bool operator!=(const Point& o) const {
-        return (x != o.x) || (y != o.y);
-    }
-
-    int sqrabs() const {
-        return x * x + y * y;
-    }
-
-    bool operator<(const Point& p) const {
-        if (x != p.x) {
-            return x < p.x;
-        }
-        return y < p.y;
-    }
-};
-
-inline std::ostream& operator<<(std::ostream& o, const Point& p) {
-    o << "<" << p.x << ", " << p.y << ">";
-    return o;
-}
-
-using Poly = std::vector<Point>;
-
-inline int vmul(const Point& u, const Point& v) {
-    return u.x * v.y - u.y * v.x;
-}
-
-inline int smul(const Point& u, const Point& v) {
-    return u.x * v.x + u.y * v.y;
-}
-
-inline int dist2(Point a, Point b) {
-    return smul(a - b, a - b);
-}
-
-template<typename T>
-T sqr(T x) {
-    return x*x;
-}
-
-template<typename TPoint>
-inline double dist(TPoint a, TPoint b) {
-    return sqrt(sqr(a.x - b.x) + sqr(a.y - b.y));
-}
-
-inline int signum(int a) {
-    return a > 0 ? 1 : a == 0 ? 0 : -1;
-}
-
-inline bool inside(Point p, const Poly& poly) {
-    bool ret = false;
-    for (size_t i = 0; i < poly.size(); ++i) {
-        const auto& u = poly[i];
-        const auto& v = poly[i + 1 == poly.size() ? 0 : i + 1];
-        if (u == p) {
-            return true;
-        }
-        if (u.y == p.y && v.y == p.y && signum(u.x - p.x) * signum(v.x - p.x) <= 0) {
-            return true;
-        }
-        if ((u.y > p.y) != (v.y > p.y)) {
-            int slope = vmul(u - p, v - p);
-            if (slope == 0) {
-                return true;
-            }
-            ret ^= (slope > 0) == (u.y <= p.y);
-        }
-    }
-    return ret;
-}
-
-inline bool isect(Point ua, Point ub, Point va, Point vb) {
-    return
-        signum(vmul(ub - ua, va - ua)) * signum(vmul(ub - ua, vb - ua)) < 0 &&
-        signum(vmul(vb - va, ua - va)) * signum(vmul(vb - va, ub - va)) < 0;
-}
-
-inline bool between(Point a, Point mid, Point b) {
-    auto v1 = a - mid;
-    auto v2 = b - mid;
-    return vmul(v1, v2) == 0 && smul(v1, v2) <= 0;
-}
-
-inline bool isect(Point ua, Point ub, Poly poly) {
-    for (size_t i = 0; i < poly.size(); ++i) {
-        const auto& a = poly[i];
-        const auto& b = poly[i + 1 == poly.size() ? 0 : i + 1];
-        if (between(ua, b, ub)) {
-            const auto& c = poly[i + 2 >= poly.size() ? i + 2 - poly.size() : i + 2];
-            auto interior = [&](Point p) {
-                if (vmul(c - b, a - b) >= 0) {
-                    return vmul(c - b, p - b) >= 0 && vmul(p - b, a - b) >= 0;
-                } else {
-                    return vmul(c - b, p - b) >= 0 || vmul(p - b, a - b) >= 0;
-                }
-            };
-            if (!interior(ua) || !interior(ub)) {
-                return true;
-            }
-        } else if(between(ua, a, ub)) {
-            continue;
-        } else if(between(a, ua, b)) {
-            if (vmul(a - b, ub - b) >= 0) {
-                return true;
-            }
-        } else if(between(a, ub, b)) {
-            if (vmul(a - b, ua - b) >= 0) {
-                return true;
-            }
-        } else if (isect(ua, ub, a, b)) {
-            return true;
-        }
-    }
-    return false;
-}
-
 struct Line {
     Line(const Point& x, const Point& y) {
         a = x.y - y.y;
@@ -198,72 +78,235 @@ struct Problem {
     Poly originalPoints;
     std::vector<std::vector<int>> adjEdgeIds;
     std::vector<int> edgeU, edgeV;
+    // Per edge: 1 / original squared length. The squared lengths allowed by
+    // eps are model->edge_lo and model->edge_hi.
+    std::vector<double> edgeInvDist2;
+    // Per edge: class in annuli of the offsets allowed by the model bounds.
+    std::vector<unsigned> edgeAnnulus;
+    AnnulusTable annuli;
     double eps;
     double epsSqrtMax;
     double epsSqrtMin;
     int minx, maxx, miny, maxy;
+    uint64_t sourceHash = 0;
+
+    // The compiled problem, shared with Task when both solver families
+    // work on the same file.
+    std::shared_ptr<const ProblemModel> model;
 
     void parseJson(const std::string& fn) {
-        std::ifstream is(fn);
-        if (!is) {
-            std::cerr << "File " << fn << " not found." << std::endl;
-            throw std::exception();
-        }
-        json rawProblem;
-        is >> rawProblem;
-        eps = int(rawProblem["epsilon"]) / 1000000.0;
+        init(ProblemModel::Load(fn));
+    }
+
+    void init(std::shared_ptr<const ProblemModel> m) {
+        model = m;
+        sourceHash = model->source_hash;
+        eps = model->eps / 1000000.0;
         epsSqrtMax = std::sqrt(1.0 + eps);
         epsSqrtMin = std::sqrt(1.0 - eps);
-        hole.resize(rawProblem["hole"].size());
-        for (size_t i = 0; i < hole.size(); ++i) {
-            hole[i] = {rawProblem["hole"][i][0], rawProblem["hole"][i][1]};
+        hole.clear();
+        for (const auto& p : model->hole) {
+            hole.emplace_back(p.x, p.y);
         }
-        auto figure = rawProblem["figure"];
-        size_t n = figure["vertices"].size();
-        originalPoints.resize(n);
-        for (size_t i = 0; i < n; ++i) {
-            originalPoints[i] = {figure["vertices"][i][0], figure["vertices"][i][1]};
+        originalPoints.clear();
+        for (const auto& p : model->vertices) {
+            originalPoints.emplace_back(p.x, p.y);
         }
-        adjEdgeIds.resize(n);
-        for (auto e : figure["edges"]) {
-            int u = e[0], v = e[1];
-            adjEdgeIds[u].push_back(edgeU.size());
-            adjEdgeIds[v].push_back(edgeU.size());
-            edgeU.push_back(u);
-            edgeV.push_back(v);
+        adjEdgeIds.assign(originalPoints.size(), {});
+        for (size_t i = 0; i < originalPoints.size(); ++i) {
+            for (auto a = model->ArcsBegin(i); a != model->ArcsEnd(i); ++a) {
+                adjEdgeIds[i].push_back(a->edge);
+            }
+        }
+        edgeU.assign(model->edge_from.begin(), model->edge_from.end());
+        edgeV.assign(model->edge_to.begin(), model->edge_to.end());
+        edgeInvDist2.clear();
+        edgeAnnulus.clear();
+        annuli.Clear();
+        for (size_t e = 0; e < edgeU.size(); ++e) {
+            edgeInvDist2.push_back(1.0 / dist2(originalPoints[edgeU[e]], originalPoints[edgeV[e]]));
+            edgeAnnulus.push_back(annuli.Add(model->edge_lo[e], model->edge_hi[e]));
         }
     }
 
     std::vector<Point> pointsInside;
-    std::map<Point, int> pointInsideToIndex;
+    LatticeIndex pointInsideToIndex;
     std::vector<uint8_t> pointsInsideIsCorner;
     std::vector<int> corners;
 
     bool hasVisibility;
     std::vector<boost::dynamic_bitset<>> visibility;
-    std::atomic<int> edges = 0;
-
-    void calcVisibility(size_t i) {
+    // Dense visibility loaded from the precompute store stays in the mapping
+    // and is read in place; `visibility` is left empty then.
+    PrecomputeStore store;
+    bool mappedVisibility = false;
+    // Set before preprocess to keep visibility as compressed rows instead of
+    // dense bitsets; holes with 10^5 points fit in memory this way.
+    bool compressedVisibility = false;
+    std::vector<CompressedRow> compressedRows;
+    // Without preCalcVisibility rows are computed on first use, shared
+    // between threads and evicted above visibilityCacheBytes (0 = no limit).
+    size_t visibilityCacheBytes = 0;
+    VisibilityCache<boost::dynamic_bitset<>> lazyVisibility;
+    VisibilityCache<CompressedRow> lazyCompressedRows;
+    VisibilitySweep visibilitySweep;
+    std::atomic<int64_t> edges = 0;
+
+    boost::dynamic_bitset<> calcVisibility(size_t i) {
         boost::dynamic_bitset<> bs;
         bs.resize(pointsInside.size());
-        const auto p = pointsInside[i];
-        for (size_t j = 0; j < pointsInside.size(); ++j) {
-            const auto q = pointsInside[j];
-            if (!isect(p, q, hole)) {
-                bs.set(j);
-                edges++;
+        edges += visibilitySweep.calc(i, bs);
+        return bs;
+    }
+
+    // Full visibility matrix. Only the upper triangle is swept, in square
+    // tiles handed out dynamically to one worker per hardware thread; every
+    // visible pair is mirrored inside its tile. The tile side is a multiple
+    // of the bitset block size, so concurrent tiles never write the same
+    // block.
+    static constexpr size_t MAX_VISIBILITY_TILE = 2048;
+    static constexpr size_t TILES_PER_WORKER = 8;
+
+    // Largest tile side up to MAX_VISIBILITY_TILE that still gives every
+    // worker about TILES_PER_WORKER tiles, so small holes use all threads.
+    static size_t visibilityTile(size_t n, size_t numWorkers) {
+        constexpr size_t BLOCK = boost::dynamic_bitset<>::bits_per_block;
+        // T tiles per side give T (T + 1) / 2 work items.
+        const size_t perSide = static_cast<size_t>(std::ceil(std::sqrt(2.0 * TILES_PER_WORKER * numWorkers)));
+        const size_t tile = (n + perSide - 1) / perSide;
+        return std::clamp((tile + BLOCK - 1) / BLOCK * BLOCK, BLOCK, MAX_VISIBILITY_TILE);
+    }
+
+    void calcAllVisibility() {
+        const size_t n = pointsInside.size();
+        for (auto& row : visibility) {
+            row.resize(n);
+        }
+        const size_t numWorkers = std::max(1u, std::thread::hardware_concurrency());
+        const size_t tile = visibilityTile(n, numWorkers);
+        const size_t tiles = (n + tile - 1) / tile;
+        std::vector<std::pair<size_t, size_t>> work;
+        for (size_t ti = 0; ti < tiles; ++ti) {
+            for (size_t tj = ti; tj < tiles; ++tj) {
+                work.emplace_back(ti, tj);
+            }
+        }
+        std::atomic<size_t> nextTile = 0;
+        std::vector<int64_t> visiblePairs(numWorkers, 0);
+
+        auto worker = [&](size_t iWorker) {
+            int64_t count = 0;
+            for (size_t t = nextTile++; t < work.size(); t = nextTile++) {
+                const size_t rowBegin = work[t].first * tile;
+                const size_t rowEnd = std::min(rowBegin + tile, n);
+                const size_t colBegin = work[t].second * tile;
+                const size_t colEnd = std::min(colBegin + tile, n);
+                for (size_t i = rowBegin; i < rowEnd; ++i) {
+                    auto& row = visibility[i];
+                    visibilitySweep.sweep(i, std::max(colBegin, i), colEnd, [&](size_t j) {
+                        row.set(j);
+                        visibility[j].set(i);
+                        count += i == j ? 1 : 2;
+                    });
+                }
             }
+            visiblePairs[iWorker] = count;
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t iWorker = 0; iWorker < numWorkers; ++iWorker) {
+            workers.emplace_back(worker, iWorker);
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        for (auto c : visiblePairs) {
+            edges += c;
         }
-        visibility[i].swap(bs);
     }
 
-    const boost::dynamic_bitset<>& getVisibility(size_t index) {
-        if (!hasVisibility) {
-            if (visibility[index].size() == 0) {
-                calcVisibility(index);
+    CompressedRow calcCompressedRow(size_t i) {
+        CompressedRow::Builder row;
+        edges += visibilitySweep.sweep(i, 0, pointsInside.size(), [&](size_t j) { row.push(j); });
+        return row.finish();
+    }
+
+    // Compressed rows are built row by row, so there is no mirroring; rows are
+    // handed out in chunks to one worker per hardware thread.
+    void calcAllCompressedRows() {
+        constexpr size_t CHUNK = 64;
+        const size_t n = pointsInside.size();
+        std::atomic<size_t> nextRow = 0;
+        const size_t numWorkers = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (size_t iWorker = 0; iWorker < numWorkers; ++iWorker) {
+            workers.emplace_back([&]() {
+                for (size_t begin = nextRow.fetch_add(CHUNK); begin < n; begin = nextRow.fetch_add(CHUNK)) {
+                    for (size_t i = begin; i < std::min(begin + CHUNK, n); ++i) {
+                        compressedRows[i] = calcCompressedRow(i);
+                    }
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    // Rows are returned as shared_ptr, so a lazily computed row stays valid
+    // while it is used even if the cache evicts it; precomputed rows are
+    // returned without ownership.
+    std::shared_ptr<const CompressedRow> getCompressedRow(size_t index) {
+        if (hasVisibility) {
+            return {std::shared_ptr<void>(), &compressedRows[index]};
+        }
+        return lazyCompressedRows.get(index, [&]() { return calcCompressedRow(index); });
+    }
+
+    // candidates = points visible from every point in sources.
+    void intersectVisibility(const std::vector<int>& sources, boost::dynamic_bitset<>& candidates) {
+        if (mappedVisibility) {
+            store.intersectVisibility(sources, candidates);
+            return;
+        }
+        if (compressedVisibility) {
+            std::vector<std::shared_ptr<const CompressedRow>> pinned;
+            std::vector<const CompressedRow*> rows;
+            pinned.reserve(sources.size());
+            rows.reserve(sources.size());
+            for (int s : sources) {
+                pinned.push_back(getCompressedRow(s));
+                rows.push_back(pinned.back().get());
             }
+            CompressedRow::intersect(rows, pointsInside.size(), candidates);
+            return;
+        }
+        candidates.resize(pointsInside.size());
+        candidates.set();
+        for (int s : sources) {
+            candidates &= *getVisibility(s);
         }
-        return visibility[index];
+    }
+
+    bool isVisible(size_t i, size_t j) {
+        if (mappedVisibility) {
+            return store.visible(i, j);
+        }
+        return compressedVisibility ? getCompressedRow(i)->test(j) : (*getVisibility(i))[j];
+    }
+
+    std::shared_ptr<const boost::dynamic_bitset<>> getVisibility(size_t index) {
+        if (mappedVisibility) {
+            return lazyVisibility.get(index, [&]() {
+                boost::dynamic_bitset<> row;
+                store.visibilityRow(index, row);
+                return row;
+            });
+        }
+        if (hasVisibility) {
+            return {std::shared_ptr<void>(), &visibility[index]};
+        }
+        return lazyVisibility.get(index, [&]() { return calcVisibility(index); });
     }
 
     std::vector<uint8_t> fixed;
@@ -274,7 +317,10 @@ struct Problem {
 
     std::vector<std::vector<double>> g;
 
-    void preprocess(bool preCalcVisibility = true, bool onlyBorder = false) {
+    // With a non-empty storeDir the lattice, g and visibility are loaded from
+    // (or saved to) a PrecomputeStore file; onlyBorder samples randomly and
+    // never uses the store.
+    void preprocess(bool preCalcVisibility = true, bool onlyBorder = false, const std::string& storeDir = "") {
         fixed.assign(originalPoints.size(), 0);
         int sum = 0;
         for (size_t i = 0; i < hole.size(); ++i) {
@@ -295,63 +341,132 @@ struct Problem {
             miny = std::min(miny, p.y);
             maxy = std::max(maxy, p.y);
         }
-        pointsInside.resize(0);
-        pointsInsideIsCorner.resize(0);
-        for (int x = minx; x <= maxx; ++x) {
-            for (int y = miny; y <= maxy; ++y) {
-                Point p(x, y);
-                if (inside(p, hole)) {
-                    const bool corner = std::find(hole.begin(), hole.end(), p) != hole.end();
-                    if (!onlyBorder || corner || ((rand() % 10) == 0)) {
-                        pointInsideToIndex.emplace(p, static_cast<int>(pointsInside.size()));
-                        corners.emplace_back(static_cast<int>(pointsInside.size()));
-                        pointsInside.push_back(p);
-                        pointsInsideIsCorner.push_back(corner);
-                    }
-                }
+
+        const bool useStore = !storeDir.empty() && !onlyBorder;
+        const std::string storeFile = useStore ? PrecomputeStore::fileName(storeDir, sourceHash) : "";
+        const bool stored = useStore && store.open(storeFile, sourceHash, originalPoints.size());
+        const bool storedVisibility = stored && store.header().hasVisibility;
+        if (stored) {
+            setPointsInside(store.points(), store.isCorner());
+            g = store.distances();
+        } else {
+            calcPointsInside(onlyBorder);
+            calcDistances();
+        }
+
+        visibilitySweep = VisibilitySweep(hole, pointsInside);
+        hasVisibility = preCalcVisibility;
+        const bool denseVisibility = preCalcVisibility && !compressedVisibility;
+        mappedVisibility = denseVisibility && storedVisibility;
+        visibility.assign(denseVisibility && !mappedVisibility ? pointsInside.size() : 0, {});
+        compressedRows.assign(preCalcVisibility && compressedVisibility ? pointsInside.size() : 0, {});
+        lazyVisibility.reset((preCalcVisibility && !mappedVisibility) || compressedVisibility ? 0 : pointsInside.size(),
+                             visibilityCacheBytes);
+        lazyCompressedRows.reset(preCalcVisibility || !compressedVisibility ? 0 : pointsInside.size(), visibilityCacheBytes);
+        if (preCalcVisibility && compressedVisibility) {
+            calcAllCompressedRows();
+            std::cerr << pointsInside.size() << " " << edges << " (compressed)\n";
+        } else if (mappedVisibility) {
+            // Counting edges would page in the whole matrix.
+            std::cerr << pointsInside.size() << " (mapped)\n";
+        } else if (denseVisibility) {
+            calcAllVisibility();
+            std::cerr << pointsInside.size() << " " << edges << "\n";
+        } else {
+            std::cerr << pointsInside.size() << "\n";
+        }
+
+        if (useStore && (!stored || (denseVisibility && !storedVisibility))) {
+            if (!PrecomputeStore::write(storeFile, sourceHash, pointsInside, pointsInsideIsCorner, g,
+                                        denseVisibility ? &visibility : nullptr)) {
+                std::cerr << "Can't write " << storeFile << std::endl;
             }
         }
-        g.assign(originalPoints.size(), std::vector(originalPoints.size(), std::numeric_limits<double>::infinity()));
-        for (size_t i = 0; i < originalPoints.size(); ++i) {
-            g[i][i] = 0;
+        if (!mappedVisibility) {
+            store.close();
         }
-        for (size_t e = 0; e < edgeU.size(); ++e) {
-            int u = edgeU[e], v = edgeV[e];
-            double maxDist = std::sqrt((1.0 + eps) * dist2(originalPoints[u], originalPoints[v]));
-            g[u][v] = std::min(g[u][v], maxDist);
-        }
-        for (size_t k = 0; k < originalPoints.size(); ++k) {
-            for (size_t i = 0; i < originalPoints.size(); ++i) {
-                for (size_t j = 0; j < originalPoints.size(); ++j) {
-                    g[i][j] = std::min(g[i][j], g[i][k] + g[k][j]);
-                }
+    }
+
+    // The lattice of the model, or a sample of it with every hole corner if
+    // onlyBorder.
+    void calcPointsInside(bool onlyBorder) {
+        std::vector<Point> points;
+        std::vector<uint8_t> isCorner;
+        for (const auto& q : model->GetLattice().points) {
+            Point p(q.x, q.y);
+            const bool corner = std::find(hole.begin(), hole.end(), p) != hole.end();
+            if (!onlyBorder || corner || ((rand() % 10) == 0)) {
+                points.push_back(p);
+                isCorner.push_back(corner);
             }
         }
+        setPointsInside(std::move(points), std::move(isCorner));
+    }
 
-        hasVisibility = preCalcVisibility;
-        visibility.assign(pointsInside.size(), {});
-        if (preCalcVisibility) {
-            constexpr int NUM_THREADS = 64;
-
-            auto doThreadJob = [&](size_t iThread) {
-                size_t begin = (pointsInside.size() * iThread) / NUM_THREADS;
-                size_t end = (pointsInside.size() * (iThread + 1)) / NUM_THREADS;
-                for (size_t block = begin; block < end; ++block) {
-                    calcVisibility(block);
-                }
-            };
+    void setPointsInside(std::vector<Point> points, std::vector<uint8_t> isCorner) {
+        pointsInside = std::move(points);
+        pointsInsideIsCorner = std::move(isCorner);
+        pointInsideToIndex.Init(minx, miny, maxx, maxy);
+        corners.clear();
+        for (size_t i = 0; i < pointsInside.size(); ++i) {
+            pointInsideToIndex.Add(pointsInside[i].x, pointsInside[i].y);
+            corners.emplace_back(static_cast<int>(i));
+        }
+        pointInsideToIndex.Build();
+    }
 
-            std::vector<std::future<void>> jobs;
-            for (size_t iThread = 0; iThread < NUM_THREADS; ++iThread) {
-                jobs.emplace_back(std::async(std::launch::async, doThreadJob, iThread));
+    // Index in pointsInside, -1 for points that are not there.
+    int pointIndex(const Point& p) const {
+        return pointInsideToIndex.Get(p.x, p.y);
+    }
+
+    // Calls f(k) for the points k of candidates allowed for vertex at by the
+    // placed neighbours in ps. The points are enumerated on the ring of the
+    // neighbour with the smallest annulus if that is cheaper than scanning
+    // candidates; the other edges are left to the caller.
+    template <class TCallback>
+    void forEachCandidate(int at, const std::vector<int>& ps, const boost::dynamic_bitset<>& candidates, TCallback f) const {
+        int bestE = -1;
+        size_t bestSize = candidates.count();
+        for (auto e : adjEdgeIds[at]) {
+            int j = edgeU[e] ^ edgeV[e] ^ at;
+            if (ps[j] != -1 && annuli.Size(edgeAnnulus[e]) < bestSize) {
+                bestE = e;
+                bestSize = annuli.Size(edgeAnnulus[e]);
             }
-            for (auto& f : jobs) {
-                f.wait();
+        }
+        if (bestE == -1) {
+            for (auto k = candidates.find_first(); k != candidates.npos; k = candidates.find_next(k)) {
+                f(k);
             }
+            return;
+        }
+        const Point q = pointsInside[ps[edgeU[bestE] ^ edgeV[bestE] ^ at]];
+        annuli.ForEach(pointInsideToIndex, I2Point(q.x, q.y), edgeAnnulus[bestE], [&](unsigned k) {
+            if (candidates.test(k)) {
+                f(k);
+            }
+        });
+    }
 
-            std::cerr << pointsInside.size() << " " << edges << "\n";
-        } else {
-            std::cerr << pointsInside.size() << "\n";
+    // Index of the closest point of pointsInside.
+    int nearestPointIndex(const Point& p) const {
+        return pointInsideToIndex.Nearest(p.x, p.y);
+    }
+
+    // g[i][j] = upper bound of the distance between vertices i and j, from
+    // the reach bounds of the model.
+    void calcDistances() {
+        const size_t n = originalPoints.size();
+        const std::vector<double> row(n, std::numeric_limits<double>::infinity());
+        g.assign(n, row);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                const int64_t r = model->Reach(i, j);
+                if (r < ProblemModel::unreachable * ProblemModel::unreachable) {
+                    g[i][j] = std::sqrt(static_cast<double>(r));
+                }
+            }
         }
     }
 
@@ -380,14 +495,16 @@ struct Problem {
             }
             size_t cnt = 0;
             boost::dynamic_bitset<> candidates;
-            candidates.resize(pointsInside.size(), true);
+            std::vector<int> sources;
             for (auto e : adjEdgeIds[at]) {
                 int j = edgeU[e] ^ edgeV[e] ^ at;
                 if (ps[j] != -1) {
-                    candidates &= getVisibility(ps[j]);
+                    sources.push_back(ps[j]);
                 }
             }
-            for (ps[at] = candidates.find_first(); ps[at] != candidates.npos; ps[at] = candidates.find_next(ps[at])) {
+            intersectVisibility(sources, candidates);
+            forEachCandidate(at, ps, candidates, [&](size_t k) {
+                ps[at] = k;
                 bool good = true;
                 for (auto e : adjEdgeIds[at]) {
                     int u = edgeU[e], v = edgeV[e];
@@ -399,7 +516,7 @@ struct Problem {
                 if (good) {
                     cnt++;
                 }
-            }
+            });
             ps[at] = -1;
             if (cnt == 0) {
                 return;
@@ -411,14 +528,9 @@ struct Problem {
         }
         size_t at = bestAt;
         if (at == ps.size()) {
-            int opt = 0;
-            for (size_t i = 0; i < hole.size(); ++i) {
-                int d = 1000000000;
-                for (size_t j = 0; j < ps.size(); ++j) {
-                    d = std::min(d, dist2(hole[i], pointsInside[ps[j]]));
-                }
-                opt += d;
-            }
+            DislikeTracker<Point> dislike;
+            dislike.Init(hole, positions(ps));
+            int opt = dislike.Score();
             if (opt < minOpt) {
                 minOpt = opt;
                 std::cout << minOpt << " " << exportSol(ps) << std::endl;
@@ -426,17 +538,18 @@ struct Problem {
             return;
         }
         boost::dynamic_bitset<> candidates;
-        candidates.resize(pointsInside.size(), true);
+        std::vector<int> sources;
         for (auto e : adjEdgeIds[at]) {
             int j = edgeU[e] ^ edgeV[e] ^ at;
             if (ps[j] != -1) {
-                candidates &= getVisibility(ps[j]);
+                sources.push_back(ps[j]);
             }
         }
+        intersectVisibility(sources, candidates);
         std::vector<int> cs;
-        for (auto i = candidates.find_first(); i != candidates.npos; i = candidates.find_next(i)) {
-            cs.push_back(i);
-        }
+        forEachCandidate(at, ps, candidates, [&](size_t k) {
+            cs.push_back(k);
+        });
         std::shuffle(cs.begin(), cs.end(), gen);
         // for (ps[at] = candidates.find_first(); ps[at] != candidates.npos; ps[at] = candidates.find_next(ps[at])) {
         for (int x : cs) {
@@ -513,7 +626,7 @@ struct Problem {
                 if (p2c[u] != -1 && p2c[v] != -1) {
                     double d1 = dist2(hole[p2c[u]], hole[p2c[v]]);
                     double d2 = dist2(originalPoints[u], originalPoints[v]);
-                    good &= getVisibility(c2i[p2c[u]])[c2i[p2c[v]]] && std::abs(d1 / d2 - 1.0) <= eps + 1e-8;
+                    good &= isVisible(c2i[p2c[u]], c2i[p2c[v]]) && std::abs(d1 / d2 - 1.0) <= eps + 1e-8;
                 }
             }
             for (size_t j = 0; j < i; ++j) {
@@ -539,21 +652,23 @@ struct Problem {
         rec2(c2p, p2c, 0);
     }
 
+    std::vector<Point> positions(const std::vector<int>& points) const {
+        std::vector<Point> result(points.size());
+        for (size_t i = 0; i < points.size(); ++i) {
+            result[i] = pointsInside[points[i]];
+        }
+        return result;
+    }
+
     void updateE(SolutionCandidate& current) const {
-        current.optE = 0;
+        DislikeTracker<Point> dislike;
+        dislike.Init(hole, positions(current.points));
+        current.optE = dislike.Score();
         current.constE = 0;
-        for (size_t h = 0; h < hole.size(); ++h) {
-            int mind = 1000000000;
-            for (size_t i = 0; i < originalPoints.size(); ++i) {
-                mind = std::min(mind, dist2(hole[h], pointsInside[current.points[i]]));
-            }
-            current.optE += mind;
-        }
         for (size_t e = 0; e < edgeU.size(); ++e) {
             int i = edgeU[e];
             int j = edgeV[e];
-            // TODO cache denom
-            double distMeasure = std::abs(1.0 * dist2(pointsInside[current.points[i]], pointsInside[current.points[j]]) / dist2(originalPoints[i], originalPoints[j]) - 1.0);
+            double distMeasure = std::abs(dist2(pointsInside[current.points[i]], pointsInside[current.points[j]]) * edgeInvDist2[e] - 1.0);
             distMeasure = std::max(0.0, distMeasure - eps - 1e-12);
             current.constE += distMeasure;
         }
@@ -621,7 +736,10 @@ struct GibbsChain {
         }
         std::shuffle(scan.begin(), scan.end(), gen);
         std::vector<uint8_t> first(problem.edgeU.size(), true), cnt(problem.edgeU.size(), 0);
-        std::vector<int> distNotI(problem.hole.size(), 1000000000);
+        DislikeTracker<Point> dislike;
+        if (onlyFeasible) {
+            dislike.Init(problem.hole, problem.positions(current.points));
+        }
         for (int i : scan) {
             if (problem.fixed[i]) {
                 continue;
@@ -630,64 +748,168 @@ struct GibbsChain {
                 first[e] = cnt[e]++ == 0;
             }
             boost::dynamic_bitset<> candidates;
-            candidates.resize(problem.pointsInside.size(), true);
+            std::vector<int> sources;
             for (auto e : problem.adjEdgeIds[i]) {
                 int j = problem.edgeU[e] ^ problem.edgeV[e] ^ i;
-                candidates &= problem.getVisibility(current.points[j]);
+                sources.push_back(current.points[j]);
             }
+            problem.intersectVisibility(sources, candidates);
             if (candidates.count() == 0) {
                 continue;
             }
-            double selW = -std::numeric_limits<double>::infinity();
-            size_t selCandidate = -1;
+            const size_t selCandidate = sample(i, candidates, dislike);
+            if (selCandidate == candidates.npos) {
+                continue;
+            }
+            current.points[i] = selCandidate;
             if (onlyFeasible) {
-                distNotI.assign(problem.hole.size(), 1000000000);
-                for (size_t j = 0; j < problem.originalPoints.size(); ++j) {
-                    if (i == j) {
-                        continue;
-                    }
-                    for (size_t h = 0; h < problem.hole.size(); ++h) {
-                        distNotI[h] = std::min(distNotI[h], dist2(problem.hole[h], problem.pointsInside[current.points[j]]));
-                    }
-                }
+                dislike.Move(i, problem.pointsInside[selCandidate]);
             }
-            for (size_t curCandidate = candidates.find_first(); curCandidate != candidates.npos; curCandidate = candidates.find_next(curCandidate)) {
-                double w = 0.0;
-                bool skip = false;
-                for (auto e : problem.adjEdgeIds[i]) {
-                    int j = problem.edgeU[e] ^ problem.edgeV[e] ^ i;
-                    // TODO cache denom
-                    double distMeasure = std::abs(1.0 * dist2(problem.pointsInside[curCandidate], problem.pointsInside[current.points[j]]) / dist2(problem.originalPoints[i], problem.originalPoints[j]) - 1.0);
-                    distMeasure = std::max(0.0, distMeasure - problem.eps - 1e-12);
-                    if (onlyFeasible) {
-                        if (distMeasure > 0) {
-                            skip = true;
-                            break;
-                        }
-                    } else {
-                        w += distMeasure;
-                    }
-                }
-                if (skip) {
-                    continue;
-                }
-                if (onlyFeasible) {
-                    for (size_t h = 0; h < problem.hole.size(); ++h) {
-                        w -= std::max(0, distNotI[h] - dist2(problem.hole[h], problem.pointsInside[curCandidate]));
-                    }
-                }
+        }
+        problem.updateE(current);
+    }
+
+private:
+    // Candidates of the vertex being resampled as coordinate arrays, and
+    // their weights. Kept between steps to avoid reallocation.
+    std::vector<int> candIdx, candX, candY;
+    std::vector<uint8_t> candBad;
+    std::vector<int64_t> candGain;
+    std::vector<double> candW;
+
+    // The candidate arrays are padded to a multiple of LANES and the kernels
+    // below run over the padding too. At -O2 GCC only vectorizes a loop when
+    // no scalar tail is needed and no runtime alias check, hence the padded
+    // trip count and __restrict.
+    static constexpr size_t LANES = 16;
+
+    static size_t padded(size_t n) {
+        return (n + LANES - 1) & ~(LANES - 1);
+    }
+
+    static void markBadLength(const int* __restrict x, const int* __restrict y, uint8_t* __restrict bad, size_t n,
+                              Point q, int lo, int hi) {
+        n = padded(n);
+        for (size_t k = 0; k < n; ++k) {
+            const int dx = x[k] - q.x, dy = y[k] - q.y;
+            const int d = dx * dx + dy * dy;
+            bad[k] |= (d < lo) | (d > hi);
+        }
+    }
+
+    static void addLengthPenalty(const int* __restrict x, const int* __restrict y, double* __restrict w, size_t n,
+                                 Point q, double inv, double tol) {
+        n = padded(n);
+        for (size_t k = 0; k < n; ++k) {
+            const int dx = x[k] - q.x, dy = y[k] - q.y;
+            w[k] += std::max(0.0, std::abs((dx * dx + dy * dy) * inv - 1.0) - tol);
+        }
+    }
 
-                w *= -invT;
-                double mx = std::max(selW, w);
-                double p = 1.0 / (1.0 + std::exp(selW - w));
-                if (std::uniform_real_distribution()(gen) <= p) {
-                    selCandidate = curCandidate;
+    static void addDislikeGain(const int* __restrict x, const int* __restrict y, int64_t* __restrict gain, size_t n,
+                               Point c, int64_t without) {
+        n = padded(n);
+        for (size_t k = 0; k < n; ++k) {
+            const int dx = x[k] - c.x, dy = y[k] - c.y;
+            gain[k] += std::max<int64_t>(0, without - (dx * dx + dy * dy));
+        }
+    }
+
+    static void scale(const int64_t* __restrict gain, double* __restrict w, size_t n, double factor) {
+        n = padded(n);
+        for (size_t k = 0; k < n; ++k) {
+            w[k] = factor * gain[k];
+        }
+    }
+
+    static void scale(double* __restrict w, size_t n, double factor) {
+        n = padded(n);
+        for (size_t k = 0; k < n; ++k) {
+            w[k] *= factor;
+        }
+    }
+
+    // Draws a new position for vertex i from the conditional distribution
+    // over candidates, npos if every candidate breaks an edge. The per-edge
+    // and per-hole-vertex passes are the flat kernels above; sampling takes
+    // one exp per candidate.
+    size_t sample(int i, const boost::dynamic_bitset<>& candidates, const DislikeTracker<Point>& dislike) {
+        size_t n = candidates.count();
+        candIdx.resize(n);
+        candX.resize(padded(n));
+        candY.resize(padded(n));
+        size_t m = 0;
+        auto add = [&](size_t k) {
+            candIdx[m] = k;
+            candX[m] = problem.pointsInside[k].x;
+            candY[m] = problem.pointsInside[k].y;
+            ++m;
+        };
+        if (onlyFeasible) {
+            // Infeasible candidates get no weight, so the ring of the
+            // tightest edge is enough.
+            problem.forEachCandidate(i, current.points, candidates, add);
+            n = m;
+        } else {
+            for (size_t k = candidates.find_first(); k != candidates.npos; k = candidates.find_next(k)) {
+                add(k);
+            }
+        }
+        int* x = candX.data();
+        int* y = candY.data();
+        candBad.assign(padded(n), 0);
+        candW.assign(padded(n), 0.0);
+        uint8_t* bad = candBad.data();
+        double* w = candW.data();
+        for (auto e : problem.adjEdgeIds[i]) {
+            const int j = problem.edgeU[e] ^ problem.edgeV[e] ^ i;
+            const Point q = problem.pointsInside[current.points[j]];
+            if (onlyFeasible) {
+                markBadLength(x, y, bad, n, q, problem.model->edge_lo[e], problem.model->edge_hi[e]);
+            } else {
+                addLengthPenalty(x, y, w, n, q, problem.edgeInvDist2[e], problem.eps + 1e-12);
+            }
+        }
+        if (onlyFeasible) {
+            // Only candidates that keep every edge feasible are weighted.
+            m = 0;
+            for (size_t k = 0; k < n; ++k) {
+                if (!bad[k]) {
+                    candIdx[m] = candIdx[k];
+                    x[m] = x[k];
+                    y[m] = y[k];
+                    ++m;
                 }
-                selW = std::log(std::exp(selW - mx) + std::exp(w - mx)) + mx;
             }
-            current.points[i] = selCandidate;
+            if (m == 0) {
+                return candidates.npos;
+            }
+            n = m;
+            candGain.assign(padded(n), 0);
+            int64_t* gain = candGain.data();
+            for (size_t h = 0; h < problem.hole.size(); ++h) {
+                addDislikeGain(x, y, gain, n, problem.hole[h], dislike.DistanceWithout(h, i));
+            }
+            scale(gain, w, n, invT);
+        } else {
+            scale(w, n, -invT);
         }
-        problem.updateE(current);
+
+        const double mx = *std::max_element(w, w + n);
+        double total = 0.0;
+        for (size_t k = 0; k < n; ++k) {
+            w[k] = std::exp(w[k] - mx);
+            total += w[k];
+        }
+        double u = std::uniform_real_distribution(0.0, total)(gen);
+        size_t sel = 0;
+        for (; sel + 1 < n; ++sel) {
+            u -= w[sel];
+            if (u < 0) {
+                break;
+            }
+        }
+        return candIdx[sel];
     }
 };
 
@@ -702,18 +924,8 @@ struct Initer {
 
     void setInitialCandidate(std::vector<Point>& candidate, bool fix_corners) {
         for (size_t i = 0; i < candidate.size(); i++) {
-            int min_j = -1;
-            int min_dist = 0;
-            for (size_t j = 0; j < problem.pointsInside.size(); j++) {
-                int dist = (candidate[i] - problem.pointsInside[j]).sqrabs();
-                if (min_j == -1 || dist < min_dist) {
-                    min_j = j;
-                    min_dist = dist;
-                    if (dist == 0) {
-                        break;
-                    }
-                }
-            }
+            int min_j = problem.nearestPointIndex(candidate[i]);
+            int min_dist = (candidate[i] - problem.pointsInside[min_j]).sqrabs();
             if (fix_corners && min_dist == 0 && std::count(problem.corners.begin(), problem.corners.end(), min_j)) {
                 problem.fixed[i] = true;
                 std::cout << "Fixing point " << i << std::endl;
@@ -0,0 +1,271 @@
+#pragma once
+
+#include "geometry.h"
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include <boost/dynamic_bitset.hpp>
+
+// Visibility rows from the visibility polygon of the source point.
+//
+// Seen from the source p, the directions to the hole vertices cut the plane
+// into wedges. Inside one wedge no vertex is met, so the hole edges crossed by
+// a ray from p and their order along it stay the same: the visibility polygon
+// is bounded in that wedge by the nearest of them. An angular sweep over the
+// wedges keeps the crossed edges in a set ordered by distance along the
+// wedge's direction, so the nearest edge of every wedge costs O(log H).
+//
+// The polygon is then rasterized column by column. Points are stored sorted
+// by x, then y, and inside a column the direction from p turns monotonically,
+// so the wedge of each target is found by moving a pointer one way. A target
+// strictly inside a wedge is visible iff it is not beyond the wedge's edge
+// (and the wedge leaves p into the hole when p is on the boundary). Targets on
+// a ray through a vertex, where touching the boundary matters, are decided by
+// isect itself. A row costs O(H log H) plus O(1) per target and per wedge
+// crossed by a column, and is identical to isect(p, q, hole) for every q.
+//
+// The hole must be counter-clockwise, as Problem::preprocess leaves it.
+class VisibilitySweep {
+public:
+    VisibilitySweep() = default;
+
+    VisibilitySweep(const Poly& hole, const std::vector<Point>& points): hole(hole), points(points) {
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (i == 0 || points[i].x != points[i - 1].x) {
+                columns.push_back(i);
+            }
+        }
+        columns.push_back(points.size());
+    }
+
+    // Sets bits of points visible from points[index], returns their number.
+    size_t calc(size_t index, boost::dynamic_bitset<>& bs) const {
+        return sweep(index, 0, points.size(), [&](size_t j) { bs.set(j); });
+    }
+
+    // Calls visible(j) for every j in [begin, end) such that points[j] is
+    // visible from points[index], returns their number.
+    template <class F>
+    size_t sweep(size_t index, size_t begin, size_t end, F&& visible) const {
+        const Point p = points[index];
+        std::vector<Point> dirs;
+        std::vector<int> nearest;
+        polygon(p, dirs, nearest);
+        const size_t m = dirs.size();
+
+        size_t count = 0;
+        auto test = [&](size_t j, size_t& k, bool clockwise) {
+            const Point q = points[j];
+            const Point w = q - p;
+            bool ok;
+            if (m == 0 || w == Point()) {
+                ok = !isect(p, q, hole);
+            } else {
+                while (!sameDirection(w, dirs[k]) && !insideWedge(dirs, k, w)) {
+                    if (clockwise) {
+                        k = k == 0 ? m - 1 : k - 1;
+                    } else {
+                        k = k + 1 == m ? 0 : k + 1;
+                    }
+                }
+                if (sameDirection(w, dirs[k])) {
+                    ok = !isect(p, q, hole);
+                } else if (nearest[k] < 0) {
+                    ok = false;
+                } else {
+                    const Point& a = hole[nearest[k]];
+                    const Point& b = hole[nearest[k] + 1 == static_cast<int>(hole.size()) ? 0 : nearest[k] + 1];
+                    // p is never on the line of a bounding edge.
+                    ok = signum(vmul(b - a, q - a)) != -signum(vmul(b - a, p - a));
+                }
+            }
+            if (ok) {
+                visible(j);
+                ++count;
+            }
+        };
+
+        // Targets are visited in increasing order. Going up a column the
+        // direction from p turns counter-clockwise right of p and clockwise
+        // left of it.
+        size_t c = std::upper_bound(columns.begin(), columns.end(), begin) - columns.begin() - 1;
+        for (; c + 1 < columns.size() && columns[c] < end; ++c) {
+            const size_t cbegin = std::max(columns[c], begin), cend = std::min(columns[c + 1], end);
+            const bool clockwise = points[cbegin].x < p.x;
+            size_t k = 0;
+            if (m > 0 && points[cbegin] != p) {
+                const size_t upper = std::upper_bound(dirs.begin(), dirs.end(), points[cbegin] - p, angleLess) - dirs.begin();
+                k = upper == 0 ? m - 1 : upper - 1;
+            }
+            for (size_t j = cbegin; j < cend; ++j) {
+                test(j, k, clockwise);
+            }
+        }
+        return count;
+    }
+
+private:
+    // 0 for directions in [0, pi) from the x axis, 1 for [pi, 2 pi).
+    static int half(Point u) {
+        return u.y > 0 || (u.y == 0 && u.x > 0) ? 0 : 1;
+    }
+
+    static bool angleLess(Point u, Point v) {
+        const int hu = half(u), hv = half(v);
+        return hu != hv ? hu < hv : vmul(u, v) > 0;
+    }
+
+    static bool sameDirection(Point u, Point v) {
+        return vmul(u, v) == 0 && smul(u, v) > 0;
+    }
+
+    // Is w strictly between dirs[k] and the next direction counter-clockwise?
+    static bool insideWedge(const std::vector<Point>& dirs, size_t k, Point w) {
+        const Point s = dirs[k];
+        if (dirs.size() == 1) {
+            return !sameDirection(w, s);
+        }
+        const Point e = dirs[k + 1 == dirs.size() ? 0 : k + 1];
+        const long long sw = vmul(s, w), we = vmul(w, e);
+        if (vmul(s, e) > 0) {
+            return sw > 0 && we > 0;
+        }
+        // A wedge of at least pi: outside the closed wedge from e to s.
+        return !(sw <= 0 && we <= 0);
+    }
+
+    // A direction strictly inside wedge k.
+    static Point wedgeDirection(const std::vector<Point>& dirs, size_t k) {
+        const Point s = dirs[k];
+        const Point e = dirs[k + 1 == dirs.size() ? 0 : k + 1];
+        if (dirs.size() > 1 && vmul(s, e) > 0) {
+            return s + e;
+        }
+        return {-s.y, s.x};
+    }
+
+    // Does the ray from p along d start into the hole? p is on the boundary.
+    bool leavesInto(Point p, Point d, const std::vector<size_t>& through) const {
+        for (size_t k : through) {
+            const Point& a = hole[k];
+            const Point& b = hole[k + 1 == hole.size() ? 0 : k + 1];
+            if (b == p) {
+                // The corner at b is handled with the edge after it.
+                continue;
+            }
+            if (a == p) {
+                const Point& prev = hole[k == 0 ? hole.size() - 1 : k - 1];
+                if (vmul(b - a, prev - a) >= 0) {
+                    return vmul(b - a, d) > 0 && vmul(d, prev - a) > 0;
+                }
+                return vmul(b - a, d) > 0 || vmul(d, prev - a) > 0;
+            }
+            return vmul(b - a, d) > 0;
+        }
+        return true;
+    }
+
+    // Distinct directions from p to the hole vertices in angular order, and
+    // for the wedge after each of them the nearest hole edge, or -1 if
+    // nothing beyond p is visible in it.
+    void polygon(Point p, std::vector<Point>& dirs, std::vector<int>& nearest) const {
+        const size_t h = hole.size();
+        for (const auto& v : hole) {
+            if (v != p) {
+                dirs.push_back(v - p);
+            }
+        }
+        std::sort(dirs.begin(), dirs.end(), angleLess);
+        dirs.erase(std::unique(dirs.begin(), dirs.end(), sameDirection), dirs.end());
+        const size_t m = dirs.size();
+        nearest.assign(m, -1);
+        if (m == 0) {
+            return;
+        }
+        auto wedgeOf = [&](Point u) {
+            return std::lower_bound(dirs.begin(), dirs.end(), u, angleLess) - dirs.begin();
+        };
+
+        // Every edge not on a line through p blocks the wedges from its
+        // first to its second endpoint counter-clockwise.
+        std::vector<size_t> through;
+        std::vector<std::pair<size_t, size_t>> starts, ends;
+        std::vector<size_t> from(h), to(h);
+        for (size_t k = 0; k < h; ++k) {
+            const Point& a = hole[k];
+            const Point& b = hole[k + 1 == h ? 0 : k + 1];
+            if (between(a, p, b)) {
+                through.push_back(k);
+            }
+            Point u = a - p, v = b - p;
+            if (vmul(u, v) == 0) {
+                from[k] = to[k] = m;
+                continue;
+            }
+            if (vmul(u, v) < 0) {
+                std::swap(u, v);
+            }
+            from[k] = wedgeOf(u);
+            to[k] = wedgeOf(v);
+            starts.emplace_back(from[k], k);
+            ends.emplace_back(to[k], k);
+        }
+        std::sort(starts.begin(), starts.end());
+        std::sort(ends.begin(), ends.end());
+
+        // Edges never cross, so their order along the ray only changes where
+        // one of them ends.
+        Point d;
+        auto nearer = [&](size_t e1, size_t e2) {
+            auto distance = [&](size_t k) {
+                const Point& a = hole[k];
+                const Point ab = hole[k + 1 == h ? 0 : k + 1] - a;
+                long long num = vmul(a - p, ab), den = vmul(d, ab);
+                if (den < 0) {
+                    num = -num;
+                    den = -den;
+                }
+                return std::make_pair(num, den);
+            };
+            const auto [n1, d1] = distance(e1);
+            const auto [n2, d2] = distance(e2);
+            return n1 * d2 < n2 * d1;
+        };
+        std::set<size_t, decltype(nearer)> crossed(nearer);
+        std::vector<decltype(crossed)::iterator> position(h, crossed.end());
+        size_t nextStart = 0, nextEnd = 0;
+        for (size_t w = 0; w < m; ++w) {
+            d = wedgeDirection(dirs, w);
+            if (w == 0) {
+                for (size_t k = 0; k < h; ++k) {
+                    if (from[k] < m && (w + m - from[k]) % m < (to[k] + m - from[k]) % m) {
+                        position[k] = crossed.insert(k).first;
+                    }
+                }
+                for (; nextStart < starts.size() && starts[nextStart].first == 0; ++nextStart) {
+                }
+            } else {
+                for (; nextEnd < ends.size() && ends[nextEnd].first <= w; ++nextEnd) {
+                    const size_t k = ends[nextEnd].second;
+                    if (position[k] != crossed.end()) {
+                        crossed.erase(position[k]);
+                        position[k] = crossed.end();
+                    }
+                }
+                for (; nextStart < starts.size() && starts[nextStart].first == w; ++nextStart) {
+                    const size_t k = starts[nextStart].second;
+                    position[k] = crossed.insert(k).first;
+                }
+            }
+            if (!crossed.empty() && (through.empty() || leavesInto(p, d, through))) {
+                nearest[w] = *crossed.begin();
+            }
+        }
+    }
+
+    Poly hole;
+    std::vector<Point> points;
+    std::vector<size_t> columns;
+};
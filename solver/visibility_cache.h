@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/dynamic_bitset.hpp>
+
+#include "visibility_rows.h"
+
+inline size_t visibilityRowBytes(const boost::dynamic_bitset<>& row) {
+    return sizeof(row) + row.num_blocks() * sizeof(boost::dynamic_bitset<>::block_type);
+}
+
+inline size_t visibilityRowBytes(const CompressedRow& row) {
+    return row.bytes();
+}
+
+// Lazily computed visibility rows shared by concurrent chains.
+//
+// Every row is computed at most once while it is resident: the first caller
+// builds it under the row's own mutex, everyone else waits on that mutex.
+// Without a memory cap rows live until reset(), so a computed row is
+// published as a plain atomic pointer and handed out without ownership:
+// reading it takes one acquire load and no reference count.
+// With a cap, rows are handed out as owning shared_ptr, so evicting a row
+// never invalidates one that is still in use. That path goes through
+// std::atomic_load on shared_ptr, which libstdc++ implements with a global
+// pool of mutexes, plus a reference count update per call. When resident
+// rows exceed maxBytes the clock hand evicts rows that were not read since
+// its previous pass.
+template <class Row>
+class VisibilityCache {
+public:
+    using RowPtr = std::shared_ptr<const Row>;
+
+    // maxBytes == 0 disables eviction.
+    void reset(size_t numRows, size_t maxBytes) {
+        slots.reset(new Slot[numRows]);
+        this->numRows = numRows;
+        this->maxBytes = maxBytes;
+        residentBytes = 0;
+        hand = 0;
+    }
+
+    template <class F>
+    RowPtr get(size_t index, F&& calc) {
+        Slot& slot = slots[index];
+        if (!maxBytes) {
+            const Row* row = slot.published.load(std::memory_order_acquire);
+            if (!row) {
+                std::lock_guard<std::mutex> lock(slot.init);
+                row = slot.published.load(std::memory_order_relaxed);
+                if (!row) {
+                    slot.row = std::make_shared<const Row>(calc());
+                    row = slot.row.get();
+                    residentBytes += visibilityRowBytes(*row);
+                    slot.published.store(row, std::memory_order_release);
+                }
+            }
+            return {RowPtr(), row};
+        }
+        RowPtr row = std::atomic_load(&slot.row);
+        if (!row) {
+            std::lock_guard<std::mutex> lock(slot.init);
+            row = std::atomic_load(&slot.row);
+            if (!row) {
+                row = std::make_shared<const Row>(calc());
+                residentBytes += visibilityRowBytes(*row);
+                std::atomic_store(&slot.row, row);
+                if (residentBytes > maxBytes) {
+                    evict(index);
+                }
+            }
+        }
+        slot.referenced.store(true, std::memory_order_relaxed);
+        return row;
+    }
+
+    size_t bytes() const {
+        return residentBytes;
+    }
+
+private:
+    struct Slot {
+        std::mutex init;
+        // Set once the row is computed when there is no cap.
+        std::atomic<const Row*> published = nullptr;
+        RowPtr row;
+        std::atomic<bool> referenced = false;
+    };
+
+    void evict(size_t keep) {
+        std::lock_guard<std::mutex> lock(clock);
+        for (size_t scanned = 0; residentBytes > maxBytes && scanned < 2 * numRows; ++scanned) {
+            const size_t i = hand;
+            hand = hand + 1 == numRows ? 0 : hand + 1;
+            if (i == keep || slots[i].referenced.exchange(false, std::memory_order_relaxed)) {
+                continue;
+            }
+            if (RowPtr old = std::atomic_exchange(&slots[i].row, RowPtr())) {
+                residentBytes -= visibilityRowBytes(*old);
+            }
+        }
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    size_t numRows = 0;
+    size_t maxBytes = 0;
+    std::atomic<size_t> residentBytes = 0;
+    std::mutex clock;
+    size_t hand = 0;
+};
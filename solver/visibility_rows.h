@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <boost/dynamic_bitset.hpp>
+
+// Visibility row split, roaring-style, into chunks of 2^16 points, each
+// stored in the smallest of three containers: sorted 16-bit offsets, a
+// 2^16-bit bitmap, or inclusive 16-bit runs [first, last]. Points are
+// numbered column by column and a point sees a few contiguous stretches of
+// every column, so almost every chunk is a run container at 4 bytes per run.
+//
+// All containers live in one array of 16-bit values, each one a header (key,
+// kind, size) followed by its payload, so an empty row costs one vector.
+class CompressedRow {
+public:
+    // Collects indices pushed in increasing order, then packs them.
+    class Builder {
+    public:
+        void push(uint32_t j) {
+            if (!runs.empty() && runs.back() == j) {
+                ++runs.back();
+            } else {
+                runs.push_back(j);
+                runs.push_back(j + 1);
+            }
+        }
+
+        CompressedRow finish();
+
+    private:
+        // Half-open runs [runs[2k], runs[2k + 1]).
+        std::vector<uint32_t> runs;
+    };
+
+    bool empty() const {
+        return data.empty();
+    }
+
+    bool test(uint32_t j) const {
+        const size_t key = j >> CHUNK_BITS;
+        for (size_t pos = 0; pos < data.size();) {
+            const Container c = at(pos);
+            if (c.key == key) {
+                return test(c, j & CHUNK_MASK);
+            }
+            if (c.key > key) {
+                break;
+            }
+            pos = c.next;
+        }
+        return false;
+    }
+
+    size_t count() const {
+        size_t result = 0;
+        for (size_t pos = 0; pos < data.size();) {
+            const Container c = at(pos);
+            switch (c.kind) {
+                case ARRAY:
+                    result += c.size;
+                    break;
+                case BITMAP:
+                    for (size_t w = 0; w < BITMAP_WORDS; ++w) {
+                        result += __builtin_popcountll(word(c, w));
+                    }
+                    break;
+                case RUNS:
+                    for (size_t r = 0; r < c.size; ++r) {
+                        result += c.v[2 * r + 1] - c.v[2 * r] + 1;
+                    }
+                    break;
+            }
+            pos = c.next;
+        }
+        return result;
+    }
+
+    size_t bytes() const {
+        return sizeof(*this) + data.capacity() * sizeof(uint16_t);
+    }
+
+    // Writes the intersection of rows into bs; no rows means everything.
+    // Paints the first row and clears everything the others miss inside its
+    // span, so the cost is the size of the containers plus the words they
+    // cover.
+    static void intersect(const std::vector<const CompressedRow*>& rows, size_t size, boost::dynamic_bitset<>& bs) {
+        bs.resize(size);
+        if (rows.empty()) {
+            bs.set();
+            return;
+        }
+        std::vector<Block> blocks(bs.num_blocks(), 0);
+        const CompressedRow& first = *rows[0];
+        // Nothing outside [from, to) is set, so only that span matters.
+        size_t from = 0, to = 0;
+        for (size_t pos = 0; pos < first.data.size();) {
+            const Container c = at(first.data, pos);
+            paint(c, blocks);
+            if (pos == 0) {
+                from = front(c);
+            }
+            to = back(c) + 1;
+            pos = c.next;
+        }
+        for (size_t k = 1; k < rows.size() && from < to; ++k) {
+            rows[k]->keep(blocks, from, to);
+        }
+        boost::from_block_range(blocks.begin(), blocks.end(), bs);
+    }
+
+private:
+    using Block = boost::dynamic_bitset<>::block_type;
+    static constexpr size_t BITS = boost::dynamic_bitset<>::bits_per_block;
+    static constexpr uint32_t CHUNK_BITS = 16;
+    static constexpr uint32_t CHUNK_MASK = (1u << CHUNK_BITS) - 1;
+    static constexpr size_t BITMAP_WORDS = (size_t(1) << CHUNK_BITS) / BITS;
+    static constexpr size_t WORD_VALUES = sizeof(Block) / sizeof(uint16_t);
+    static constexpr size_t HEADER = 3;
+
+    enum Kind : uint16_t { ARRAY, BITMAP, RUNS };
+
+    // A decoded header: the payload v holds size offsets for ARRAY, size run
+    // pairs for RUNS and BITMAP_WORDS words for BITMAP; next is the position
+    // of the following container.
+    struct Container {
+        size_t key;
+        Kind kind;
+        size_t size;
+        const uint16_t* v;
+        size_t next;
+    };
+
+    static Container at(const std::vector<uint16_t>& data, size_t pos) {
+        Container c{data[pos], static_cast<Kind>(data[pos + 1]), data[pos + 2], data.data() + pos + HEADER, 0};
+        const size_t length = c.kind == ARRAY ? c.size : c.kind == RUNS ? 2 * c.size : BITMAP_WORDS * WORD_VALUES;
+        c.next = pos + HEADER + length;
+        return c;
+    }
+
+    Container at(size_t pos) const {
+        return at(data, pos);
+    }
+
+    static size_t base(const Container& c) {
+        return c.key << CHUNK_BITS;
+    }
+
+    static Block word(const Container& c, size_t w) {
+        Block result;
+        std::memcpy(&result, c.v + w * WORD_VALUES, sizeof(Block));
+        return result;
+    }
+
+    static bool test(const Container& c, uint16_t low) {
+        switch (c.kind) {
+            case ARRAY:
+                return std::binary_search(c.v, c.v + c.size, low);
+            case BITMAP:
+                return (word(c, low / BITS) >> (low % BITS)) & 1;
+            case RUNS: {
+                const size_t r = findRun(c, low);
+                return c.v[2 * r] <= low && low <= c.v[2 * r + 1];
+            }
+        }
+        return false;
+    }
+
+    // Index of the last run starting at or before low, or 0 if there is none.
+    static size_t findRun(const Container& c, size_t low) {
+        size_t lo = 0, hi = c.size;
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            if (c.v[2 * mid] <= low) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo > 0 ? lo - 1 : 0;
+    }
+
+    // Smallest and largest index in a non-empty container.
+    static size_t front(const Container& c) {
+        if (c.kind == BITMAP) {
+            size_t w = 0;
+            while (!word(c, w)) {
+                ++w;
+            }
+            return base(c) + w * BITS + __builtin_ctzll(word(c, w));
+        }
+        return base(c) + c.v[0];
+    }
+
+    static size_t back(const Container& c) {
+        switch (c.kind) {
+            case ARRAY:
+                return base(c) + c.v[c.size - 1];
+            case RUNS:
+                return base(c) + c.v[2 * c.size - 1];
+            case BITMAP: {
+                size_t w = BITMAP_WORDS - 1;
+                while (!word(c, w)) {
+                    --w;
+                }
+                return base(c) + w * BITS + BITS - 1 - __builtin_clzll(word(c, w));
+            }
+        }
+        return 0;
+    }
+
+    // Sets the bits of c in blocks.
+    static void paint(const Container& c, std::vector<Block>& blocks) {
+        const size_t b = base(c);
+        switch (c.kind) {
+            case ARRAY:
+                for (size_t k = 0; k < c.size; ++k) {
+                    const size_t j = b + c.v[k];
+                    blocks[j / BITS] |= Block(1) << (j % BITS);
+                }
+                break;
+            case BITMAP: {
+                const size_t n = std::min(BITMAP_WORDS, blocks.size() - b / BITS);
+                std::memcpy(blocks.data() + b / BITS, c.v, n * sizeof(Block));
+                break;
+            }
+            case RUNS:
+                for (size_t r = 0; r < c.size; ++r) {
+                    fill(blocks, b + c.v[2 * r], b + c.v[2 * r + 1] + 1, ~Block(0));
+                }
+                break;
+        }
+    }
+
+    // Clears the bits in [from, to) that are not in this row. Chunks start at
+    // block boundaries and blocks hold nothing outside [from, to), so whole
+    // blocks can be masked.
+    void keep(std::vector<Block>& blocks, size_t from, size_t to) const {
+        size_t pos = 0;
+        while (pos < data.size() && at(pos).key < (from >> CHUNK_BITS)) {
+            pos = at(pos).next;
+        }
+        for (size_t key = from >> CHUNK_BITS; (key << CHUNK_BITS) < to; ++key) {
+            const size_t lo = std::max(from, key << CHUNK_BITS), hi = std::min(to, (key + 1) << CHUNK_BITS);
+            if (pos == data.size() || at(pos).key != key) {
+                fill(blocks, lo, hi, 0);
+                continue;
+            }
+            const Container c = at(pos);
+            const size_t b = base(c);
+            switch (c.kind) {
+                case ARRAY: {
+                    size_t k = std::lower_bound(c.v, c.v + c.size, uint16_t((lo / BITS * BITS) & CHUNK_MASK)) - c.v;
+                    for (size_t w = lo / BITS; w * BITS < hi; ++w) {
+                        Block mask = 0;
+                        for (; k < c.size && b + c.v[k] < (w + 1) * BITS; ++k) {
+                            mask |= Block(1) << ((b + c.v[k]) % BITS);
+                        }
+                        blocks[w] &= mask;
+                    }
+                    break;
+                }
+                case BITMAP:
+                    for (size_t w = lo / BITS; w * BITS < hi; ++w) {
+                        blocks[w] &= word(c, w - b / BITS);
+                    }
+                    break;
+                case RUNS: {
+                    size_t kept = lo;
+                    for (size_t r = findRun(c, lo - b); r < c.size && b + c.v[2 * r] < hi; ++r) {
+                        fill(blocks, kept, b + c.v[2 * r], 0);
+                        kept = std::max(kept, b + c.v[2 * r + 1] + 1);
+                    }
+                    fill(blocks, kept, hi, 0);
+                    break;
+                }
+            }
+            pos = c.next;
+        }
+    }
+
+    // Sets bits [begin, end) of a block array to the bits of value.
+    static void fill(std::vector<Block>& blocks, size_t begin, size_t end, Block value) {
+        if (begin >= end) {
+            return;
+        }
+        const size_t first = begin / BITS, last = (end - 1) / BITS;
+        Block head = ~Block(0) << (begin % BITS);
+        const Block tail = ~Block(0) >> (BITS - 1 - (end - 1) % BITS);
+        if (first == last) {
+            head &= tail;
+        }
+        blocks[first] = (blocks[first] & ~head) | (value & head);
+        if (first == last) {
+            return;
+        }
+        std::fill(blocks.begin() + first + 1, blocks.begin() + last, value);
+        blocks[last] = (blocks[last] & ~tail) | (value & tail);
+    }
+
+    std::vector<uint16_t> data;
+};
+
+inline CompressedRow CompressedRow::Builder::finish() {
+    CompressedRow row;
+    std::vector<uint16_t>& data = row.data;
+    std::vector<uint32_t> chunk;
+    size_t r = 0;
+    while (r < runs.size()) {
+        const uint32_t key = runs[r] >> CHUNK_BITS;
+        const uint32_t chunkEnd = (key + 1) << CHUNK_BITS;
+        chunk.clear();
+        size_t card = 0;
+        while (r < runs.size() && runs[r] < chunkEnd) {
+            const uint32_t end = std::min(runs[r + 1], chunkEnd);
+            chunk.push_back(runs[r]);
+            chunk.push_back(end);
+            card += end - runs[r];
+            if (end == runs[r + 1]) {
+                r += 2;
+            } else {
+                runs[r] = end;
+            }
+        }
+        const size_t runValues = chunk.size(), bitmapValues = BITMAP_WORDS * WORD_VALUES;
+        const size_t header = data.size();
+        data.push_back(key);
+        data.push_back(RUNS);
+        data.push_back(0);
+        if (runValues <= card && runValues <= bitmapValues) {
+            for (size_t k = 0; k < chunk.size(); k += 2) {
+                data.push_back(chunk[k] & CHUNK_MASK);
+                data.push_back((chunk[k + 1] - 1) & CHUNK_MASK);
+            }
+            data[header + 2] = chunk.size() / 2;
+        } else if (card <= bitmapValues) {
+            data[header + 1] = ARRAY;
+            for (size_t k = 0; k < chunk.size(); k += 2) {
+                for (uint32_t j = chunk[k]; j < chunk[k + 1]; ++j) {
+                    data.push_back(j & CHUNK_MASK);
+                }
+            }
+            data[header + 2] = card;
+        } else {
+            data[header + 1] = BITMAP;
+            std::vector<Block> words(BITMAP_WORDS, 0);
+            for (size_t k = 0; k < chunk.size(); k += 2) {
+                fill(words, chunk[k] & CHUNK_MASK, ((chunk[k + 1] - 1) & CHUNK_MASK) + 1, ~Block(0));
+            }
+            data.resize(data.size() + bitmapValues);
+            std::memcpy(data.data() + header + HEADER, words.data(), BITMAP_WORDS * sizeof(Block));
+        }
+    }
+    runs.clear();
+    data.shrink_to_fit();
+    return row;
+}
@@ -14,6 +14,7 @@ DEFINE_int32(test_idx, 1, "Test number");
 DEFINE_string(init, "", "file from initialization");
 DEFINE_bool(corner, false, "file from initialization");
 DEFINE_bool(initer, false, "use initer");
+DEFINE_string(precompute_dir, "../precompute", "Directory for stored preprocessing results, empty to disable");
 
 using namespace std;
 
@@ -35,25 +36,124 @@ double violationsLenSoft(const Problem& p, const SolutionCandidate& current) {
     return n;
 }
 
-double e(const Problem& p, const SolutionCandidate& sc) {
+// Candidate with the terms of its energy: per-edge violations and the
+// dislike tracker.
+struct Candidate : SolutionCandidate {
+    std::vector<uint8_t> edgeIsect;
+    std::vector<double> edgeSoft;
+    DislikeTracker<Point> dislike;
+    int bnd = 0;
+    int softCount = 0;
+    double soft = 0;
+};
+
+// Energy of a candidate, kept up to date under single-vertex moves: a move
+// rescores the edges of the vertex (O(deg * H)) and the dislike (O(H)).
+struct DeltaEnergy {
     static constexpr double INF = 10000000.0;
-    double result = (static_cast<double>(10 * p.violationsBnd(sc) + violationsLenSoft(p, sc))) * INF;
-    if (!FLAGS_corner) {
-        if (result) {
-            return result + INF;
+
+    const Problem& p;
+    bool corner;
+    std::vector<double> origDist2;
+
+    DeltaEnergy(const Problem& p, bool corner) : p(p), corner(corner) {
+        origDist2.resize(p.edgeU.size());
+        for (size_t i = 0; i < origDist2.size(); ++i) {
+            origDist2[i] = dist2(p.originalPoints[p.edgeU[i]], p.originalPoints[p.edgeV[i]]);
         }
     }
 
-    for (size_t h = 0; h < p.hole.size(); ++h) {
-        int mind = 1000000000;
-        for (size_t i = 0; i < p.originalPoints.size(); ++i) {
-            mind = std::min(mind, dist2(p.hole[h], p.pointsInside[sc.points[i]]));
+    double energy(const Candidate& c) const {
+        double result = (10 * c.bnd + c.soft) * INF;
+        if (!corner) {
+            if (result) {
+                return result + INF;
+            }
         }
-        result += mind;
+        return result + c.dislike.Score();
     }
 
-    return result;
-}
+    void init(Candidate& c) const {
+        c.edgeIsect.assign(p.edgeU.size(), 0);
+        c.edgeSoft.assign(p.edgeU.size(), 0);
+        c.bnd = 0;
+        c.softCount = 0;
+        c.soft = 0;
+        for (size_t i = 0; i < p.edgeU.size(); ++i) {
+            updateEdge(c, i);
+        }
+        c.dislike.Init(p.hole, p.positions(c.points));
+        c.optE = energy(c);
+    }
+
+    void move(Candidate& c, size_t v, int to) const {
+        if (c.points[v] == to) {
+            return;
+        }
+        c.points[v] = to;
+        for (auto i : p.adjEdgeIds[v]) {
+            updateEdge(c, i);
+        }
+        c.dislike.Move(v, p.pointsInside[to]);
+        c.optE = energy(c);
+    }
+
+    // Moves every vertex to points[v], rescoring each touched edge once.
+    // Returns false without rescoring when most vertices move: a full init()
+    // is cheaper then, and the caller can run it in parallel.
+    bool assign(Candidate& c, const std::vector<int>& points) const {
+        std::vector<int> moved;
+        for (size_t v = 0; v < points.size(); ++v) {
+            if (c.points[v] != points[v]) {
+                moved.push_back(v);
+            }
+        }
+        if (2 * moved.size() > points.size()) {
+            c.points = points;
+            return false;
+        }
+        for (auto v : moved) {
+            c.points[v] = points[v];
+            c.dislike.Move(v, p.pointsInside[points[v]]);
+        }
+        std::vector<uint8_t> touched(p.edgeU.size(), 0);
+        for (auto v : moved) {
+            for (auto i : p.adjEdgeIds[v]) {
+                if (!touched[i]) {
+                    touched[i] = 1;
+                    updateEdge(c, i);
+                }
+            }
+        }
+        c.optE = energy(c);
+        return true;
+    }
+
+    void swap(Candidate& c, size_t u, size_t v) const {
+        const int pu = c.points[u], pv = c.points[v];
+        move(c, u, pv);
+        move(c, v, pu);
+    }
+
+private:
+    void updateEdge(Candidate& c, size_t i) const {
+        const auto p1 = p.pointsInside[c.points[p.edgeU[i]]];
+        const auto p2 = p.pointsInside[c.points[p.edgeV[i]]];
+        const uint8_t isect = ::isect(p1, p2, p.hole);
+        c.bnd += isect - c.edgeIsect[i];
+        c.edgeIsect[i] = isect;
+
+        const double distMeasure = std::abs(dist2(p1, p2) / origDist2[i] - 1.0);
+        const double soft = distMeasure > p.eps + 1e-8 ? 1.0 + distMeasure : 0.0;
+        c.softCount += (soft > 0) - (c.edgeSoft[i] > 0);
+        c.soft += soft - c.edgeSoft[i];
+        c.edgeSoft[i] = soft;
+        if (!c.softCount) {
+            // No rounding residue when the last violation goes away.
+            c.soft = 0;
+        }
+    }
+};
 
 struct PhysicalWorld {
     struct Ball {
@@ -124,9 +224,9 @@ struct PhysicalWorld {
     void updateCandidate(SolutionCandidate& sc) {
         for (size_t i = 0; i < balls.size(); ++i) {
             const auto& ball = balls[i];
-            auto toPoint = p.pointInsideToIndex.find(ball.toPoint());
-            if (toPoint != p.pointInsideToIndex.end()) {
-                sc.points[i] = toPoint->second;
+            int toPoint = p.pointIndex(ball.toPoint());
+            if (toPoint >= 0) {
+                sc.points[i] = toPoint;
             }
         }
     }
@@ -196,11 +296,12 @@ int main(int argc, char* argv[]) {
     Problem p;
     std::cerr << FLAGS_test_idx << " ";
     p.parseJson("../problems/" + std::to_string(FLAGS_test_idx) + ".json");
-    p.preprocess(false);
+    p.preprocess(false, false, FLAGS_precompute_dir);
     cerr << endl;
 
+    const DeltaEnergy energy(p, FLAGS_corner);
     static constexpr size_t NUM_CANDIDATES = 100;
-    vector<SolutionCandidate> population(NUM_CANDIDATES);
+    vector<Candidate> population(NUM_CANDIDATES);
     std::vector<std::future<void>> jobs;
     auto genRandomCandidate = [&](size_t i) {
         auto& c = population[i];
@@ -240,15 +341,15 @@ int main(int argc, char* argv[]) {
 
             if (i < 50) {
                 for (int i = 0; i < p.originalPoints.size(); ++i) {
-                    auto toPoint = p.pointInsideToIndex.find(p.originalPoints[i]);
-                    if (toPoint != p.pointInsideToIndex.end()) {
-                        init.current.points[i] = toPoint->second;
+                    int toPoint = p.pointIndex(p.originalPoints[i]);
+                    if (toPoint >= 0) {
+                        init.current.points[i] = toPoint;
                     }
                 }
             }
         }
         c.points = init.current.points;
-        c.optE = e(p, c);
+        energy.init(c);
         cerr << i << "/" << NUM_CANDIDATES << " " << c.optE << endl;
     };
     for (size_t i = 0; i < NUM_CANDIDATES; ++i) {
@@ -296,11 +397,10 @@ int main(int argc, char* argv[]) {
                         Point newPoint(p.pointsInside[population[i].points[idxPoint]]);
                         newPoint.x += dx;
                         newPoint.y += dy;
-                        auto toNewPoint = p.pointInsideToIndex.find(newPoint);
-                        if (toNewPoint != p.pointInsideToIndex.end()) {
-                            SolutionCandidate newC = population[i];
-                            newC.points[idxPoint] = toNewPoint->second;
-                            newC.optE = INVALID_E;
+                        int toNewPoint = p.pointIndex(newPoint);
+                        if (toNewPoint >= 0) {
+                            Candidate newC = population[i];
+                            energy.move(newC, idxPoint, toNewPoint);
                             population.emplace_back(newC);
                         }
                     }
@@ -313,17 +413,20 @@ int main(int argc, char* argv[]) {
 
         auto move = [&](int dx, int dy) {
             for (size_t i = 0; i < NUM_CANDIDATES; ++i) {
-                SolutionCandidate newC = population[i];
+                Candidate newC = population[i];
+                std::vector<int> points = newC.points;
                 for (size_t j = 0; j < numPoints; ++j) {
                     Point newPoint(p.pointsInside[population[i].points[j]]);
                     newPoint.x += dx;
                     newPoint.y += dy;
-                    auto toNewPoint = p.pointInsideToIndex.find(newPoint);
-                    if (toNewPoint != p.pointInsideToIndex.end()) {
-                        newC.points[j] = toNewPoint->second;
+                    int toNewPoint = p.pointIndex(newPoint);
+                    if (toNewPoint >= 0) {
+                        points[j] = toNewPoint;
                     }
                 }
-                newC.optE = INVALID_E;
+                if (!energy.assign(newC, points)) {
+                    newC.optE = INVALID_E;
+                }
                 population.emplace_back(newC);
             }
         };
@@ -344,77 +447,77 @@ int main(int argc, char* argv[]) {
             if (idx1 == idx2) {
                 continue;
             }
-            SolutionCandidate newC = population[idx1];
+            Candidate newC = population[idx1];
+            std::vector<int> points = newC.points;
             for (size_t j = 0; j < numPoints; ++j) {
                 if (distr100(gen) < 20) {
-                    newC.points[j] = population[idx2].points[j];
+                    points[j] = population[idx2].points[j];
                 }
             }
-            newC.optE = INVALID_E;
+            if (!energy.assign(newC, points)) {
+                newC.optE = INVALID_E;
+            }
             population.emplace_back(newC);
         }
 
         for (size_t i = 0; i < NUM_CANDIDATES * 10; ++i) {
             auto idx1 = candDistr(gen);
-            SolutionCandidate newC = population[idx1];
-            newC.points[pointDistr(gen)] = insideDistr(gen);
-            newC.optE = INVALID_E;
+            Candidate newC = population[idx1];
+            energy.move(newC, pointDistr(gen), insideDistr(gen));
             population.emplace_back(newC);
         }
 
         // collapse
         for (size_t i = 0; i < NUM_CANDIDATES; ++i) {
             auto idx1 = candDistr(gen);
-            SolutionCandidate newC = population[idx1];
-            newC.points[pointDistr(gen)] = newC.points[pointDistr(gen)];
-            newC.optE = INVALID_E;
+            Candidate newC = population[idx1];
+            auto idx2 = pointDistr(gen);
+            energy.move(newC, idx2, newC.points[pointDistr(gen)]);
             population.emplace_back(newC);
         }
 
         // collapse group
         for (size_t i = 0; i < NUM_CANDIDATES; ++i) {
             auto idx1 = candDistr(gen);
-            SolutionCandidate newC = population[idx1];
+            Candidate newC = population[idx1];
             auto target = newC.points[pointDistr(gen)];
             size_t count = pointDistr(gen);
             for (size_t j = 0; j < count; ++j) {
-                newC.points[pointDistr(gen)] = target;
+                energy.move(newC, pointDistr(gen), target);
             }
-            newC.optE = INVALID_E;
             population.emplace_back(newC);
         }
 
         // move to corner
         for (size_t i = 0; i < NUM_CANDIDATES * 10; ++i) {
             auto idx1 = candDistr(gen);
-            SolutionCandidate newC = population[idx1];
-            newC.points[pointDistr(gen)] = p.corners[cornersDistr(gen)];
-            newC.optE = INVALID_E;
+            Candidate newC = population[idx1];
+            energy.move(newC, pointDistr(gen), p.corners[cornersDistr(gen)]);
             population.emplace_back(newC);
         }
 
         auto groupMove = [&](int rad, int dx, int dy) {
             for (size_t i = 0; i < NUM_CANDIDATES * 10; ++i) {
                 auto idx1 = candDistr(gen);
-                SolutionCandidate newC = population[idx1];
+                Candidate newC = population[idx1];
                 auto idx2 = pointDistr(gen);
                 const Point center = p.pointsInside[idx2];
                 bool found = false;
-                for (auto& point : newC.points) {
+                for (size_t j = 0; j < numPoints; ++j) {
+                    const int point = newC.points[j];
                     auto d2 = dist2(center, p.pointsInside[point]);
                     if (d2 < rad * rad) {
                         Point np = p.pointsInside[point];
                         np.x += dx;
                         np.y += dy;
-                        auto toNewPoint = p.pointInsideToIndex.find(np);
-                        if (toNewPoint != p.pointInsideToIndex.end()) {
-                            point = toNewPoint->second;
+                        int toNewPoint = p.pointIndex(np);
+                        if (toNewPoint >= 0) {
+                            energy.move(newC, j, toNewPoint);
                             found = true;
                         }
                     }
                 }
                 if (found) {
-                    newC.optE = INVALID_E;
                     population.emplace_back(newC);
                 }
             }
@@ -427,7 +530,7 @@ int main(int argc, char* argv[]) {
         // group rotation
         for (size_t i = 0; i < NUM_CANDIDATES * 10; ++i) {
             auto idx1 = candDistr(gen);
-            SolutionCandidate newC = population[idx1];
+            Candidate newC = population[idx1];
 
             int x0 = xDistr(gen);
             int y0 = yDistr(gen);
@@ -439,17 +542,18 @@ int main(int argc, char* argv[]) {
             auto cosAngle = std::cos(angle);
 
             bool found = false;
-            for (auto& point : newC.points) {
+            for (size_t j = 0; j < newC.points.size(); ++j) {
+                const int point = newC.points[j];
                 auto d2 = dist2(center, p.pointsInside[point]);
                 if (d2 < rad * rad) {
                     Point np = p.pointsInside[point];
                     Point d = np - center;
                     np.x = center.x + sinAngle * d.x + cosAngle * d.y;
                     np.y = center.y - cosAngle * d.x + sinAngle * d.y;
-                    auto toNewPoint = p.pointInsideToIndex.find(np);
-                    if (toNewPoint != p.pointInsideToIndex.end()) {
-                        if (toNewPoint->second != point) {
-                            point = toNewPoint->second;
+                    int toNewPoint = p.pointIndex(np);
+                    if (toNewPoint >= 0) {
+                        if (toNewPoint != point) {
+                            energy.move(newC, j, toNewPoint);
                             found = true;
                         }
                     }
@@ -457,7 +561,6 @@ int main(int argc, char* argv[]) {
             }
 
             if (found) {
-                newC.optE = INVALID_E;
                 population.emplace_back(newC);
             }
         }
@@ -467,31 +570,33 @@ int main(int argc, char* argv[]) {
             auto idx1 = edgeDistr(gen);
             Line l(p.pointsInside[p.edgeU[idx1]], p.pointsInside[p.edgeV[idx1]]);
             auto idx2 = candDistr(gen);
-            SolutionCandidate newC = population[idx2];
-            for (size_t j = 0; j < numPoints; ++j) {
-                const Point oldPoint = p.pointsInside[newC.points[j]];
+            Candidate newC = population[idx2];
+            std::vector<int> points = newC.points;
+            for (size_t j = 0; j < points.size(); ++j) {
+                const Point oldPoint = p.pointsInside[points[j]];
                 if (l.sdist(oldPoint) > 0) {
                     Point newPoint(l.reflect(oldPoint));
-                    auto toNewPoint = p.pointInsideToIndex.find(newPoint);
-                    if (toNewPoint != p.pointInsideToIndex.end()) {
-                        newC.points[j] = toNewPoint->second;
+                    int toNewPoint = p.pointIndex(newPoint);
+                    if (toNewPoint >= 0) {
+                        points[j] = toNewPoint;
                     } else {
-                        newC.points[j] = population[idx2].points[j];
+                        points[j] = population[idx2].points[j];
                     }
                 }
             }
-            newC.optE = INVALID_E;
+            if (!energy.assign(newC, points)) {
+                newC.optE = INVALID_E;
+            }
             population.emplace_back(newC);
         }
 
         for (size_t i = 0; i < NUM_CANDIDATES * 10; ++i) {
             auto idx3 = candDistr(gen);
-            SolutionCandidate newC = population[idx3];
+            Candidate newC = population[idx3];
             auto idx1 = pointDistr(gen);
             auto idx2 = pointDistr(gen);
             if (idx1 != idx2) {
-                swap(newC.points[idx1], newC.points[idx2]);
-                newC.optE = INVALID_E;
+                energy.swap(newC, idx1, idx2);
                 population.emplace_back(newC);
             }
         }
@@ -499,16 +604,18 @@ int main(int argc, char* argv[]) {
         auto addSpringSimulation = [&](double dt, int steps, bool eps) {
             for (size_t i = 0; i < NUM_CANDIDATES * 5; ++i) {
                 auto idx3 = candDistr(gen);
-                SolutionCandidate newC = population[idx3];
+                Candidate newC = population[idx3];
                 pw.initFromCandidate(newC);
 
                 for (size_t j = 0; j < steps; ++j) {
                     pw.step(dt, eps);
                 }
 
-                pw.updateCandidate(newC);
-
-                newC.optE = INVALID_E;
+                SolutionCandidate moved = newC;
+                pw.updateCandidate(moved);
+                if (!energy.assign(newC, moved.points)) {
+                    newC.optE = INVALID_E;
+                }
                 population.emplace_back(newC);
             }
         };
@@ -542,7 +649,7 @@ int main(int argc, char* argv[]) {
             const size_t end = ((iThread + 1) * population.size()) / NUM_THREADS;
             for (size_t j = begin; j < end; ++j) {
                 if (population[j].optE == INVALID_E) {
-                    population[j].optE = e(p, population[j]);
+                    energy.init(population[j]);
                 }
             }
         };
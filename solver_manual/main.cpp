@@ -2,6 +2,8 @@
 #include <random>
 
 #include "../solver/solver.h"
+#include "common/icfpc2021/rigid_placement.h"
+#include "common/icfpc2021/solution.h"
 
 #include "json.hpp"
 
@@ -33,8 +35,8 @@ int main(int argc, char* argv[]) {
 
     auto goodPoly = [&](const Poly& pl) {
         for (size_t i = 0; i < numPoints; ++i) {
-            auto toPoint = p.pointInsideToIndex.find(pl[i]);
-            if (toPoint == p.pointInsideToIndex.end()) {
+            int toPoint = p.pointIndex(pl[i]);
+            if (toPoint < 0) {
                 return false;
             }
         }
@@ -61,19 +63,17 @@ int main(int argc, char* argv[]) {
         }
     };
 
-    auto swapXY = [&]() {
-        for (size_t i = 0; i < points.size(); ++i) {
-            auto& pp = points[i];
-            int tempX = pp.x;
-            pp.x = pp.y;
-            pp.y = p.maxx - tempX;
+    // Rigid motions (lattice symmetries and snapped rotations) are searched
+    // by RigidPlacement; only the folds below are hand-coded.
+    {
+        RigidPlacement placement(p.model);
+        Solution s;
+        if (placement.Search(s.points) || placement.SearchRotations(s.points)) {
+            cerr << "found rigid placement" << endl;
+            std::ofstream f("../solutions/manual2/" + std::to_string(FLAGS_test_idx) + ".json");
+            f << s.ToJson();
+            return 0;
         }
-    };
-
-    if (FLAGS_test_idx == 122) {
-        swapXY();
-        // shiftX(-40);
-        // shiftY(-40);
     }
 
     if (FLAGS_test_idx == 132) {
@@ -89,12 +89,12 @@ int main(int argc, char* argv[]) {
 
     sc.points.resize(numPoints);
     for (size_t i = 0; i < numPoints; ++i) {
-        auto toPoint = p.pointInsideToIndex.find(points[i]);
-        if (toPoint == p.pointInsideToIndex.end()) {
+        int toPoint = p.pointIndex(points[i]);
+        if (toPoint < 0) {
             cerr << "bad point: " << points[i] << endl;
             return 1;
         }
-        sc.points[i] = toPoint->second;
+        sc.points[i] = toPoint;
     }
 
     if (p.violationsBnd(sc)) {
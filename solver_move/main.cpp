@@ -1,88 +1,35 @@
 #include <iostream>
-#include <random>
 
-#include "../solver/solver.h"
-
-#include "json.hpp"
+#include "common/icfpc2021/problem_model.h"
+#include "common/icfpc2021/rigid_placement.h"
+#include "common/icfpc2021/solution.h"
+#include "common/timer.h"
 
 #include <gflags/gflags.h>
 
 DEFINE_int32(test_idx, 1, "Test number");
+DEFINE_bool(pi4, true, "Also try the figure rotated by pi/4 (and scaled by sqrt(2))");
+DEFINE_bool(rotations, true, "Also try other angles, with the vertices snapped to the lattice");
 
 using namespace std;
 
-using json = nlohmann::json;
-
 int main(int argc, char* argv[]) {
     gflags::ParseCommandLineFlags(&argc, &argv, true);
-    Problem p;
     std::cerr << FLAGS_test_idx << " ";
-    p.parseJson("../problems/" + std::to_string(FLAGS_test_idx) + ".json");
-    p.preprocess(false);
+    auto model = ProblemModel::Load("../problems/" + std::to_string(FLAGS_test_idx) + ".json");
     cerr << endl;
 
-    SolutionCandidate sc;
-    const auto cmHole = massCenter(p.hole);
-    cerr << "Hole MC: " << cmHole << endl;
-    const auto cmOriginal = massCenter(p.originalPoints);
-    cerr << "Original MC: " << cmOriginal << endl;
-
-    sc.points.resize(p.originalPoints.size());
-    for (int shiftX = -1000; shiftX < 1000; ++shiftX) {
-        cerr << "..." << shiftX << endl;
-        for (int shiftY = -1000; shiftY < 1000; ++shiftY) {
-            for (int reflectX = 0; reflectX < 2; ++reflectX) {
-                for (int reflectY = 0; reflectY < 2; ++reflectY) {
-                    for (int trans = 0; trans < 2; ++trans) {
-                        auto good = [&](int dx, int dy, bool trans, bool reflextX, bool reflectY) {
-                            for (size_t i = 0; i < p.originalPoints.size(); ++i) {
-                                Point op = p.originalPoints[i];
-                                if (reflectX) {
-                                    op.x = -op.x;
-                                }
-                                if (reflectY) {
-                                    op.y = -op.y;
-                                }
-                                Point np = op;
-                                if (!trans) {
-                                    np.x = op.x + dx;
-                                    np.y = op.y + dy;
-                                } else {
-                                    np.y = op.x + dx;
-                                    np.x = op.y + dy;
-                                }
-                                auto toPoint = p.pointInsideToIndex.find(np);
-                                if (toPoint != p.pointInsideToIndex.end()) {
-                                    sc.points[i] = toPoint->second;
-                                } else {
-                                    // cerr << "No solution " << i << " (" << np.x << ", " << np.y << ")" << endl;
-                                    return false;
-                                }
-                            }
-
-                            if (p.violationsBnd(sc)) {
-                                return false;
-                            }
-
-                            if (p.violationsLen(sc)) {
-                                return false;
-                            }
-
-                            cerr << "found " << dx << " " << dy << endl;
-                            std::ofstream f("../solutions/move/" + std::to_string(FLAGS_test_idx) + ".json");
-                            f << p.exportSol(sc.points);
-
-                            return true;
-                        };
-
-                        if (good(shiftX, shiftY, trans, reflectX, reflectY)) {
-                            return 0;
-                        }
-                    }
-                }
-            }
-        }
+    Timer t;
+    RigidPlacement placement(model);
+    Solution s;
+    if (!placement.Search(s.points, FLAGS_pi4) &&
+        !(FLAGS_rotations && placement.SearchRotations(s.points))) {
+        cerr << "No solution (" << t.GetMilliseconds() << " ms)" << endl;
+        return 0;
     }
+    cerr << "found in " << t.GetMilliseconds() << " ms" << endl;
+    std::ofstream f("../solutions/move/" + std::to_string(FLAGS_test_idx) + ".json");
+    f << s.ToJson();
 
     return 0;
 }